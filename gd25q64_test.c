@@ -22,6 +22,7 @@
 #include <stdint.h>
 #include "gd25qxx.h"
 #include <sys/ioctl.h>
+#include <poll.h>
 
 
 #define  num 16
@@ -31,13 +32,16 @@ static uint32_t mode;
 static uint32_t erase_sector_offset;
 static int verbose;
 static int erase_chip = 0;   //擦除整个芯片
+static int erase_async = 0;  //后台擦除，poll等待并打印进度
+static int batch = 0;        //-w写入时用GD25QXX_IOC_BATCH，写完在同一次调用里读回来比较
 static char *input_tx = NULL;
 static char *input_filename = NULL;
 static char *output_filename = NULL;
 static int start_address;
 static int addr_flag = 0;  //设置了地址，就用设置的地址，否则使用当前地址
 static int op_lenght = 16;
-static int operation = 0;   //0读操作，1写操作，2是擦除操作
+static int operation = 0;   //0读操作，1写操作，2是擦除操作，5是校验，6是查空白
+static int csum_type = GD25QXX_CSUM_CRC32;
 
 void print_data(const char *title, char *dat, int count)
 {
@@ -63,11 +67,15 @@ static void print_usage(const char *prog)
         "  -v --verbose  Verbose (show tx buffer)\n"
         "  -e --erase sector  erase sector \n"
         "  -E --erase chip  erase chip\n"
+        "  -A --async   erase in background, show progress\n"
+        "  -B --batch   with -w: write and read back in one GD25QXX_IOC_BATCH call\n"
         "  -a --address  start address (default 0)\n"
         "  -l --lenght  operation bytes count (default 16,or(-p) string length) \n"
         "  -w --write data   Send data to flash (e.g. \"1234\\xde\\xad\")\n"
         "  -i --inputfile    read inputfile and write to flash\n"
         "  -o --outputfile   read from flash and write to outputfile\n"
+        "  -C --checksum type  checksum -a/-l range in the driver (crc32, crc32c, sha256)\n"
+        "  -b --blank   blank check -a/-l range (4KB aligned), driver remembers blank sectors\n"
 );
    exit(1);
 }
@@ -79,17 +87,21 @@ static void parse_opts(int argc, char *argv[])
          { "device",  1, 0, 'D' },
          { "erase sector",1,0,'e'},
          { "erase chip",0,0,'E'},
+         { "async",0,0,'A'},
+         { "batch",0,0,'B'},
          { "verbose", 0, 0, 'v' },
          { "address", 1, 0, 'a' },
          { "lenght", 1, 0, 'l' },
          { "write", 1, 0, 'w' },
          { "inputfile", 1, 0, 'i' },
          { "outputfile", 1, 0, 'o' },
+         { "checksum", 1, 0, 'C' },
+         { "blank", 0, 0, 'b' },
          { NULL, 0, 0, 0 },
       };
       int c;
 
-      c = getopt_long(argc, argv, "D:e:Ew:va:l:i:o:", lopts, NULL);
+      c = getopt_long(argc, argv, "D:e:EABw:va:l:i:o:C:b", lopts, NULL);
 
       if (c == -1)
       {
@@ -113,6 +125,14 @@ static void parse_opts(int argc, char *argv[])
          operation = 2;
          printf("erase_chip\n");
          break;
+      case 'A':
+         erase_async = 1;
+         printf("erase_async\n");
+         break;
+      case 'B':
+         batch = 1;
+         printf("batch\n");
+         break;
       case 'v':
          verbose = 1;
          printf("verbose\n");
@@ -149,6 +169,20 @@ static void parse_opts(int argc, char *argv[])
             operation = 4;
          printf("output_filename = %s\n",output_filename);
          break;   
+      case 'C':
+         if(!strcmp(optarg,"crc32c"))
+            csum_type = GD25QXX_CSUM_CRC32C;
+         else if(!strcmp(optarg,"sha256"))
+            csum_type = GD25QXX_CSUM_SHA256;
+         else
+            csum_type = GD25QXX_CSUM_CRC32;
+         operation = 5;
+         printf("checksum = %s\n",optarg);
+         break;
+      case 'b':
+         operation = 6;
+         printf("blank check\n");
+         break;
       default:
          print_usage(argv[0]);
          break;
@@ -222,8 +256,8 @@ int main(int argc, char *argv[])
    }
 
    printf("buflen = %d\n",buflen);
-   buf = malloc(buflen);
-   if(!buf)
+   //按页对齐，大块读的时候驱动可以直接DMA到这块内存
+   if(posix_memalign((void **)&buf, 4096, buflen))
    {
       printf("ERROR: malloc\n");
       return -1;
@@ -344,6 +378,31 @@ int main(int argc, char *argv[])
          }
          printf("file write success\n");
       }
+      else if(batch)
+      {
+         //写和读回两个操作一次ioctl做完，地址直接写在操作里，不用lseek
+         struct gd25qxx_op ops[2];
+         struct gd25qxx_batch b;
+         int len = strlen(input_tx);
+         char *rbuf = malloc(len);
+
+         memset(ops, 0, sizeof(ops));
+         ops[0].op = GD25QXX_OP_WRITE;
+         ops[0].addr = start_address;
+         ops[0].len = len;
+         ops[0].buf = (uintptr_t)input_tx;
+         ops[1].op = GD25QXX_OP_READ;
+         ops[1].addr = start_address;
+         ops[1].len = len;
+         ops[1].buf = (uintptr_t)rbuf;
+         b.ops = (uintptr_t)ops;
+         b.count = 2;
+         ret = ioctl(fd, GD25QXX_IOC_BATCH, &b);
+         printf("batch ret = %d failed = %d status = %d %d\n",ret,b.failed,ops[0].status,ops[1].status);
+         if(ret == 0)
+            printf("read back %s\n",memcmp(input_tx,rbuf,len) ? "different" : "same");
+         free(rbuf);
+      }
       else
       {
           /*写入数据*/          
@@ -360,20 +419,88 @@ int main(int argc, char *argv[])
    }
    else if(2==operation){  //擦除操作
       printf("operation : erase \n");
-      if(erase_chip)
+      if(erase_async)
+      {
+         struct gd25qxx_erase_job job;
+         struct gd25qxx_erase_status st;
+         struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+
+         job.addr = erase_chip ? 0 : (erase_sector_offset & ~(GD25QXX_SECTOR-1));
+         job.len = erase_chip ? size0 : (unsigned int)((op_lenght + GD25QXX_SECTOR - 1) & ~(GD25QXX_SECTOR-1));
+         job.eventfd = -1;
+         ret = ioctl(fd, GD25QXX_IOC_ERASE_ASYNC, &job);
+         if(ret < 0)
+         {
+            printf("ERROR: async erase ret = %d errno = %d\n",ret,errno);
+            close(fd);
+            return -1;
+         }
+         printf("erase job %u: addr %#x len %#x\n",job.id,job.addr,job.len);
+         do   //擦除的时候程序可以做别的事，这里只是每半秒打印一次进度
+         {
+            ret = poll(&pfd, 1, 500);
+            st.id = job.id;
+            if(ioctl(fd, GD25QXX_IOC_ERASE_STATUS, &st) < 0)
+               break;
+            printf("erased %u/%u bytes, %u ms\n",st.done,st.len,st.elapsed_ms);
+         } while(st.status == -EINPROGRESS);
+         printf("erase job %u status = %d\n",st.id,st.status);
+      }
+      else if(erase_chip)
       {
          printf("operation : erase chip\n");
          ioctl(fd, GD25QXX_IOC_CHIP_ERASE, op_lenght);
       }
       else
       {
-      	 printf("operation : erase_sector_offset = %d \n",erase_sector_offset);
-         ret = lseek(fd,erase_sector_offset,SEEK_SET);
-         ret = ioctl(fd, GD25QXX_IOC_SECTOR_ERASE, op_lenght);         
+         //地址和长度一起传给驱动，扩大到4KB对齐，不用先lseek
+         struct gd25qxx_erase_range range;
+
+         range.addr = erase_sector_offset & ~(GD25QXX_SECTOR-1);
+         range.len = ((erase_sector_offset + op_lenght + GD25QXX_SECTOR - 1) & ~(GD25QXX_SECTOR-1)) - range.addr;
+      	 printf("operation : erase addr %#x len %#x \n",range.addr,range.len);
+         ret = ioctl(fd, GD25QXX_IOC_RANGE_ERASE, &range);
+         if(ret < 0)
+            printf("ERROR: erase ret = %d errno = %d\n",ret,errno);
       }
    }
 
 
+   else if(5==operation){  //校验，驱动里读flash算，数据不用读上来
+      struct gd25qxx_checksum ck;
+
+      memset(&ck, 0, sizeof(ck));
+      ck.addr = start_address;
+      ck.len = op_lenght;
+      ck.type = csum_type;
+      ret = ioctl(fd, GD25QXX_IOC_CHECKSUM, &ck);
+      if(ret < 0)
+         printf("ERROR: checksum ret = %d errno = %d\n",ret,errno);
+      else if(ck.digest_len == 4)
+         printf("addr %#x len %#x: %08x\n",ck.addr,ck.len,*(uint32_t *)ck.digest);
+      else
+      {
+         printf("addr %#x len %#x: ",ck.addr,ck.len);
+         for(i = 0; i < (int)ck.digest_len; i++)
+            printf("%02x",ck.digest[i]);
+         printf("\n");
+      }
+   }
+
+
+   else if(6==operation){  //查空白，以后写这些扇区不用读出来判断，擦除也会跳过
+      struct gd25qxx_blank_check bc;
+
+      bc.addr = start_address & ~(GD25QXX_SECTOR-1);
+      bc.len = ((start_address + op_lenght + GD25QXX_SECTOR - 1) & ~(GD25QXX_SECTOR-1)) - bc.addr;
+      ret = ioctl(fd, GD25QXX_IOC_BLANK_CHECK, &bc);
+      if(ret < 0)
+         printf("ERROR: blank check ret = %d errno = %d\n",ret,errno);
+      else
+         printf("addr %#x len %#x: %u/%u sectors blank\n",bc.addr,bc.len,bc.blank,bc.len/GD25QXX_SECTOR);
+   }
+
+
    //程序结束，做一下处理工作
    free(buf);
    close(fd);
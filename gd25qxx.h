@@ -13,12 +13,187 @@
 /* IOCTL commands */
 #define GD25QXX_MAGIC			'J'
 
-/*Erase SPI Flash*/
+/*
+ * Erase SPI Flash at the fd's file position. SECTOR_ERASE takes a byte
+ * count, the block erases erase one block. New code should use
+ * GD25QXX_IOC_RANGE_ERASE.
+ */
 #define GD25QXX_IOC_SECTOR_ERASE			_IOW(GD25QXX_MAGIC, 6, __u32)
 #define GD25QXX_IOC_32KB_BLOCK_ERASE		_IOW(GD25QXX_MAGIC, 7, __u32)
 #define GD25QXX_IOC_64KB_BLOCK_ERASE		_IOW(GD25QXX_MAGIC, 8, __u32)
 #define GD25QXX_IOC_CHIP_ERASE			_IOW(GD25QXX_MAGIC, 9, __u32)
 #define GD25QXX_IOC_GET_CAPACITY			_IOW(GD25QXX_MAGIC, 10, __u32)
 #define GD25QXX_IOC_GET_ID			_IOW(GD25QXX_MAGIC, 11, __u32)
+/*Read mode, see GD25QXX_READ_xxx*/
+#define GD25QXX_IOC_SET_READ_MODE		_IOW(GD25QXX_MAGIC, 12, __u32)
+#define GD25QXX_IOC_GET_READ_MODE		_IOR(GD25QXX_MAGIC, 13, __u32)
+
+/*
+ * Erase [addr, addr+len) in one call, with the fewest erase commands.
+ * Both must be aligned to the smallest erase size in GD25QXX_IOC_GET_GEOMETRY
+ * (GD25QXX_SECTOR on all supported chips). Returns when the erase is done.
+ * Writes into the range from other openers wait until it is finished.
+ */
+struct gd25qxx_erase_range {
+	__u32 addr;
+	__u32 len;
+};
+#define GD25QXX_IOC_RANGE_ERASE		_IOW(GD25QXX_MAGIC, 14, struct gd25qxx_erase_range)
+/*
+ * Declare that [addr, addr+len) will be rewritten from start to end by
+ * sequential writes on this fd, so the driver may erase it ahead of the
+ * writer. Data in the range that is not written is lost. Both must be
+ * GD25QXX_SECTOR aligned, len 0 ends the stream.
+ */
+#define GD25QXX_IOC_STREAM_BEGIN	_IOW(GD25QXX_MAGIC, 16, struct gd25qxx_erase_range)
+
+/*
+ * Asynchronous erase: returns at once with a job id, the driver erases in
+ * the background. Completion is signalled by poll() returning POLLOUT, by
+ * the optional eventfd, and by GD25QXX_IOC_ERASE_STATUS. One job per device,
+ * -EBUSY while one is running. addr 0 with len = capacity uses chip erase.
+ */
+struct gd25qxx_erase_job {
+	__u32 addr;		/* GD25QXX_SECTOR aligned */
+	__u32 len;		/* GD25QXX_SECTOR aligned */
+	__s32 eventfd;		/* signalled on completion, -1 = none */
+	__u32 id;		/* out */
+};
+#define GD25QXX_IOC_ERASE_ASYNC		_IOWR(GD25QXX_MAGIC, 17, struct gd25qxx_erase_job)
+
+struct gd25qxx_erase_status {
+	__u32 id;		/* in: job id, 0 = latest; out: job id */
+	__s32 status;		/* -EINPROGRESS while running, 0 done, else -errno */
+	__u32 addr;
+	__u32 len;
+	__u32 done;		/* bytes erased so far */
+	__u32 elapsed_ms;
+};
+#define GD25QXX_IOC_ERASE_STATUS	_IOWR(GD25QXX_MAGIC, 18, struct gd25qxx_erase_status)
+
+/*
+ * Batch: run ops[0..count) in order under one device lock, stop at the
+ * first failure. status of each op that ran is len (0 for ERASE) or
+ * -errno, failed is the index of the failing op or -1. The ioctl returns
+ * 0 or the failing op's error. Write data is copied in before and read
+ * data copied out after the lock, so a bad buffer fails the whole batch
+ * with -EFAULT before anything runs; READ/WRITE lengths together may not
+ * exceed the flash size (-E2BIG). The lock is only released while waiting
+ * for an erase to finish, so the batch is not fully atomic.
+ */
+#define GD25QXX_OP_READ			1	/* flash -> buf */
+#define GD25QXX_OP_WRITE		2	/* buf -> flash, like write(): erases sectors as needed */
+#define GD25QXX_OP_ERASE		3	/* GD25QXX_SECTOR aligned, buf unused */
+
+#define GD25QXX_OP_F_ERASED		0x1	/* WRITE: range is known erased, only program */
+
+struct gd25qxx_op {
+	__u32 op;		/* GD25QXX_OP_xxx */
+	__u32 flags;		/* GD25QXX_OP_F_xxx */
+	__u32 addr;
+	__u32 len;
+	__u64 buf;		/* user pointer */
+	__s32 status;		/* out */
+	__u32 reserved;
+};
+
+struct gd25qxx_batch {
+	__u64 ops;		/* user pointer to struct gd25qxx_op[count] */
+	__u32 count;		/* at most GD25QXX_BATCH_MAX */
+	__s32 failed;		/* out */
+};
+#define GD25QXX_BATCH_MAX		1024
+#define GD25QXX_IOC_BATCH		_IOWR(GD25QXX_MAGIC, 19, struct gd25qxx_batch)
+
+/*
+ * Checksum [addr, addr+len) inside the driver, read straight from the
+ * flash with the fastest read mode in use, nothing is copied to user space.
+ * CRC32/CRC32C use seed ~0 and a final inversion (the zlib/iSCSI values),
+ * the result is a host-endian __u32 at the start of digest. SHA256 needs
+ * the kernel crypto API (CONFIG_CRYPTO_SHA256), else -EOPNOTSUPP.
+ * VERIFY computes the same and compares the first digest_len bytes,
+ * returning 0 on match and -EBADMSG on mismatch.
+ */
+#define GD25QXX_CSUM_CRC32		1
+#define GD25QXX_CSUM_CRC32C		2
+#define GD25QXX_CSUM_SHA256		3
+
+struct gd25qxx_checksum {
+	__u32 addr;
+	__u32 len;
+	__u32 type;		/* GD25QXX_CSUM_xxx */
+	__u32 digest_len;	/* out for CHECKSUM: 4 or 32 */
+	__u8 digest[32];	/* out for CHECKSUM, in for VERIFY */
+};
+#define GD25QXX_IOC_CHECKSUM		_IOWR(GD25QXX_MAGIC, 20, struct gd25qxx_checksum)
+#define GD25QXX_IOC_VERIFY		_IOW(GD25QXX_MAGIC, 21, struct gd25qxx_checksum)
+
+/*
+ * Read [addr, addr+len) (GD25QXX_SECTOR aligned) and record which sectors
+ * are blank (all 0xff). The driver keeps this across erases and programs:
+ * writes to a known-blank sector skip the read-back, erases of known-blank
+ * sectors are skipped. Nothing is known blank after the driver loads.
+ */
+struct gd25qxx_blank_check {
+	__u32 addr;
+	__u32 len;
+	__u32 blank;		/* out: blank sectors in the range */
+};
+#define GD25QXX_IOC_BLANK_CHECK		_IOWR(GD25QXX_MAGIC, 22, struct gd25qxx_blank_check)
+
+/* Read modes: AUTO picks the fastest one the controller and QE bit allow */
+#define GD25QXX_READ_AUTO		0
+#define GD25QXX_READ_NORMAL		1	/* 0x03, 1-1-1 */
+#define GD25QXX_READ_FAST		2	/* 0x0B, 1-1-1, 8 dummy clocks */
+#define GD25QXX_READ_DUAL		3	/* 0x3B, 1-1-2, 8 dummy clocks */
+#define GD25QXX_READ_QUAD		4	/* 0x6B, 1-1-4, 8 dummy clocks */
+#define GD25QXX_READ_QUAD_IO		5	/* 0xEB, 1-4-4, M7-0 + 4 dummy clocks */
+#define GD25QXX_READ_MODE_MAX		GD25QXX_READ_QUAD_IO
+
+/*
+ * Flash parameters found at probe: from SFDP (JESD216), else from the
+ * driver's JEDEC ID table, else from the DT flash_size property.
+ * Times are 0 when the source does not give them.
+ */
+#define GD25QXX_GEOM_SFDP		1
+#define GD25QXX_GEOM_ID_TABLE		2
+#define GD25QXX_GEOM_DT			3
+
+/* How addresses are sent, chips over 16MB need 4 bytes */
+#define GD25QXX_ADDR_3B			0
+#define GD25QXX_ADDR_4B_OPCODES		1	/* 4-byte opcodes 0x13/0x0C/0x12/0x21/0xDC..., chip stays in 3-byte mode */
+#define GD25QXX_ADDR_EN4B		2	/* chip switched to 4-byte mode with EN4B (0xB7) */
+#define GD25QXX_ADDR_4B_ONLY		3	/* chip only has 4-byte addressing */
+
+struct gd25qxx_erase_type {
+	__u32 size;		/* bytes, 0 = not supported */
+	__u32 opcode;
+	__u32 typ_ms;
+	__u32 max_ms;
+};
+
+struct gd25qxx_read_cmd {
+	__u8 opcode;		/* 0 = not supported, 4-byte opcode in GD25QXX_ADDR_4B_OPCODES mode */
+	__u8 addr_width;	/* address lines, 1/2/4 */
+	__u8 data_width;	/* data lines, 1/2/4 */
+	__u8 dummy_clocks;	/* mode + wait clocks between address and data */
+};
+
+struct gd25qxx_geometry {
+	__u32 jedec_id;
+	__u32 source;		/* GD25QXX_GEOM_xxx */
+	__u32 size;		/* bytes */
+	__u32 page_size;
+	struct gd25qxx_erase_type erase[4];
+	struct gd25qxx_read_cmd read[GD25QXX_READ_MODE_MAX + 1];	/* by GD25QXX_READ_xxx */
+	__u32 read_mode;	/* the one in use, never AUTO */
+	__u32 page_program_typ_us;
+	__u32 page_program_max_us;
+	__u32 chip_erase_typ_ms;
+	__u32 chip_erase_max_ms;
+	__u32 addr_bytes;	/* 3 or 4 */
+	__u32 addr_mode;	/* GD25QXX_ADDR_xxx */
+};
+#define GD25QXX_IOC_GET_GEOMETRY	_IOR(GD25QXX_MAGIC, 15, struct gd25qxx_geometry)
 #endif /* GD25QXX_H */
 
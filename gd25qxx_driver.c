@@ -18,15 +18,40 @@
 #include <linux/of.h>
 #include <linux/of_device.h>
 #include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/highmem.h>
+#include <linux/dma-mapping.h>
+#include <linux/uio.h>
+#include <linux/aio.h>
+#include <linux/sched.h>
+#include <linux/mmu_context.h>
+#include <linux/workqueue.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/crc32.h>
+#include <linux/crc32c.h>
+#include <linux/poll.h>
+#include <linux/eventfd.h>
+#include <linux/bitmap.h>
 
 #include <linux/spi/spi.h>
 #include <linux/spi/spidev.h>
+#include <linux/mtd/mtd.h>
+#include <linux/mtd/partitions.h>
+#include <linux/version.h>
+#include <crypto/hash.h>
 
 #include <linux/delay.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
 #include <linux/uaccess.h>
 #include <linux/of_gpio.h>
 #include "gd25qxx.h"
 
+#define CREATE_TRACE_POINTS
+#include "gd25qxx_trace.h"
+
 /*
  * This supports access to SPI devices using normal userspace I/O calls.
  * Note that while traditional UNIX/POSIX I/O semantics are half duplex,
@@ -49,16 +74,187 @@
 #define READ_DATA 		0x03
 #define WRITE_STATUS_REG 0x01
 #define READ_STATUS_REG 0x05
+#define READ_STATUS_REG2 0x35
 #define CHIP_ERASE 		0xc7
 #define SECTOR_ERASE 	0x20
 #define BLOCK_32KB_ERASE 0x52
 #define BLOCK_64KB_ERASE 0xD8
 #define READ_DEVICE_ID 	0x90
 #define READ_UID 		0x9F
+#define FAST_READ 		0x0B
+#define FAST_READ_DUAL 	0x3B
+#define FAST_READ_QUAD 	0x6B
+#define FAST_READ_QUAD_IO 0xEB
+#define READ_SFDP		0x5A
+#define ERASE_SUSPEND	0x75
+#define ERASE_RESUME	0x7A
+#define ENTER_4B_MODE	0xB7	//EN4B，之后所有带地址的命令都用4字节地址
+#define EXIT_4B_MODE	0xE9	//EX4B
+//4字节地址的专用命令，和上面的3字节命令一一对应，不改变芯片的地址模式
+#define READ_DATA_4B		0x13
+#define FAST_READ_4B		0x0C
+#define FAST_READ_DUAL_4B	0x3C
+#define FAST_READ_QUAD_4B	0x6C
+#define FAST_READ_QUAD_IO_4B	0xEC
+#define PAGE_PROGRAM_4B		0x12
+#define SECTOR_ERASE_4B		0x21
+#define BLOCK_64KB_ERASE_4B	0xDC
+
+#define STATUS_WIP		(1<<0)
+#define STATUS2_QE		(1<<1)	//状态寄存器2的QE位(S9)，置1后WP/HOLD作为IO2/IO3
 
 static DECLARE_BITMAP(minors, N_SPI_MINORS);
 
 
+/*
+ * 读命令表，probe时复制一份到每个设备，再按SFDP改命令码和dummy，
+ * 芯片不支持的命令码为0。
+ * dummy是地址之后、数据之前的空字节数，按地址的线宽计算：
+ * 0x0B/0x3B/0x6B 是8个dummy时钟(单线1字节)，
+ * 0xEB 是 M7-0(四线1字节) 加4个dummy时钟(四线2字节)。
+ * 0xEB 的M位发0x00，不进入连续读模式。
+ */
+struct gd25q_read_op {
+	u8	opcode;
+	u8	addr_nbits;
+	u8	dummy;
+	u8	data_nbits;
+	const char *name;
+};
+
+static const struct gd25q_read_op gd25q_read_ops[] = {
+	[GD25QXX_READ_NORMAL]	= { READ_DATA, SPI_NBITS_SINGLE, 0, SPI_NBITS_SINGLE, "normal" },
+	[GD25QXX_READ_FAST]	= { FAST_READ, SPI_NBITS_SINGLE, 1, SPI_NBITS_SINGLE, "fast" },
+	[GD25QXX_READ_DUAL]	= { FAST_READ_DUAL, SPI_NBITS_SINGLE, 1, SPI_NBITS_DUAL, "dual" },
+	[GD25QXX_READ_QUAD]	= { FAST_READ_QUAD, SPI_NBITS_SINGLE, 1, SPI_NBITS_QUAD, "quad" },
+	[GD25QXX_READ_QUAD_IO]	= { FAST_READ_QUAD_IO, SPI_NBITS_QUAD, 3, SPI_NBITS_QUAD, "quad-io" },
+};
+#define GD25Q_MAX_DUMMY		8	//最多支持的dummy字节数
+
+/*
+ * 芯片上一次发出的、需要等待WIP清零的操作。
+ * 空闲时读操作不用再去查状态寄存器。
+ */
+enum gd25q_busy_op {
+	GD25Q_IDLE,
+	GD25Q_BUSY_UNKNOWN,	//刚probe，不知道芯片的状态
+	GD25Q_BUSY_WRSR,
+	GD25Q_BUSY_PP,
+	GD25Q_BUSY_SE,		//SE以后都是擦除
+	GD25Q_BUSY_BE32,
+	GD25Q_BUSY_BE64,
+	GD25Q_BUSY_CE,
+};
+
+/*
+ * 每类操作的查询间隔和超时，超时按GD25Q64C手册的最大值再留余量：
+ * tW 15ms, tPP 2.4ms, tSE 400ms, tBE32 1.6s, tBE64 2s, tCE 60s
+ * SFDP里有典型/最大时间的芯片，probe时按SFDP重新算(每个设备一份)。
+ */
+struct gd25q_busy_timing {
+	unsigned int	poll_us;
+	unsigned int	timeout_ms;
+	const char	*name;
+};
+
+static const struct gd25q_busy_timing gd25q_busy_timing[] = {
+	[GD25Q_BUSY_UNKNOWN]	= { 1000, 1000, "unknown" },	//没接芯片时读到0xff，不要等太久
+	[GD25Q_BUSY_WRSR]	= { 1000, 50, "write status" },
+	[GD25Q_BUSY_PP]		= { 100, 10, "page program" },
+	[GD25Q_BUSY_SE]		= { 2000, 1000, "sector erase" },
+	[GD25Q_BUSY_BE32]	= { 10000, 3000, "32KB block erase" },
+	[GD25Q_BUSY_BE64]	= { 10000, 4000, "64KB block erase" },
+	[GD25Q_BUSY_CE]		= { 100000, 120000, "chip erase" },
+};
+
+//没有SFDP时用的擦除命令，时间是GD25Q64C手册的最大值
+static const struct gd25qxx_erase_type gd25q_default_erase[4] = {
+	{ GD25QXX_SECTOR, SECTOR_ERASE, 0, 400 },
+	{ GD25QXX_32KB_BLOCK, BLOCK_32KB_ERASE, 0, 1600 },
+	{ GD25QXX_64KB_BLOCK, BLOCK_64KB_ERASE, 0, 2000 },
+};
+
+/*
+ * 4字节地址命令的支持位，和SFDP 4字节地址命令表(4BAIT)DW1的定义一样，
+ * 擦除类型i的4字节命令码在4BAIT DW2的第i个字节。
+ */
+#define GD25Q_4B_READ		BIT(0)	//0x13
+#define GD25Q_4B_FAST		BIT(1)	//0x0C
+#define GD25Q_4B_DUAL		BIT(2)	//0x3C
+#define GD25Q_4B_QUAD		BIT(4)	//0x6C
+#define GD25Q_4B_QUAD_IO	BIT(5)	//0xEC
+#define GD25Q_4B_PP		BIT(6)	//0x12
+#define GD25Q_4B_ERASE(i)	BIT(9 + (i))
+
+static const struct {
+	u8	opcode;
+	u32	bit;
+} gd25q_read_ops_4b[] = {
+	[GD25QXX_READ_NORMAL]	= { READ_DATA_4B, GD25Q_4B_READ },
+	[GD25QXX_READ_FAST]	= { FAST_READ_4B, GD25Q_4B_FAST },
+	[GD25QXX_READ_DUAL]	= { FAST_READ_DUAL_4B, GD25Q_4B_DUAL },
+	[GD25QXX_READ_QUAD]	= { FAST_READ_QUAD_4B, GD25Q_4B_QUAD },
+	[GD25QXX_READ_QUAD_IO]	= { FAST_READ_QUAD_IO_4B, GD25Q_4B_QUAD_IO },
+};
+
+/*
+ * SFDP读不到时按JEDEC ID查容量。
+ * ID是 厂商(0xC8 GigaDevice, 0xEF Winbond) 类型 容量，容量0x14-0x19对应1MB-32MB，
+ * W25Q512是0x20。
+ * GD25Q_F_4B_OPCODES：芯片有0x13/0x0C/0x12/0x21/0xDC这几个4字节地址命令。
+ */
+#define GD25Q_F_4B_OPCODES	BIT(0)
+
+struct gd25q_flash_info {
+	u32		jedec_id;
+	u32		size;
+	const char	*name;
+	unsigned int	flags;
+};
+
+static const struct gd25q_flash_info gd25q_flash_ids[] = {
+	{ 0xc84014, 0x100000, "GD25Q80" },
+	{ 0xc84015, 0x200000, "GD25Q16" },
+	{ 0xc84016, 0x400000, "GD25Q32" },
+	{ 0xc84017, 0x800000, "GD25Q64" },
+	{ 0xc84018, 0x1000000, "GD25Q128" },
+	{ 0xc84019, 0x2000000, "GD25Q256", GD25Q_F_4B_OPCODES },
+	{ 0xef4014, 0x100000, "W25Q80" },
+	{ 0xef4015, 0x200000, "W25Q16" },
+	{ 0xef4016, 0x400000, "W25Q32" },
+	{ 0xef4017, 0x800000, "W25Q64" },
+	{ 0xef4018, 0x1000000, "W25Q128" },
+	{ 0xef4019, 0x2000000, "W25Q256", GD25Q_F_4B_OPCODES },
+	{ 0xef4020, 0x4000000, "W25Q512", GD25Q_F_4B_OPCODES },
+};
+
+/*
+ * 统计，在debugfs的gd25qxx/<spi设备名>/stats里看，往这个文件写任何内容清零。
+ * 热路径上只做原子加。延时直方图按log2(微秒)分桶：
+ * 桶0是<1us，桶n是[2^(n-1), 2^n)us。
+ * 读的延时是一次读命令的时间，写/擦除的延时是从发命令到WIP清零的时间。
+ */
+#define GD25Q_LAT_BUCKETS	28	//2^27us约134s，比整片擦除的超时还长
+
+struct gd25q_stats {
+	atomic64_t	bytes_read;		//读出给用户/mtd的字节数
+	atomic64_t	bytes_written;		//用户/mtd要求写的字节数
+	atomic64_t	bytes_programmed;	//实际页编程的字节数
+	atomic64_t	page_programs;
+	atomic64_t	sector_erases;
+	atomic64_t	block32_erases;
+	atomic64_t	block64_erases;
+	atomic64_t	chip_erases;
+	atomic64_t	rmw_erases;		//GD25qxx_need_erase判断要擦除，读-擦-写的次数
+	atomic64_t	erase_suspends;		//读的时候暂停擦除的次数
+	atomic64_t	ahead_erased;		//顺序写时后台预擦除的字节数
+	atomic64_t	ahead_stalls;		//写的时候预擦除还没擦到，当场擦除的次数
+	atomic64_t	blank_skips;		//已知空白不用发的擦除命令数
+	atomic64_t	status_polls;
+	atomic_t	lat_read[GD25Q_LAT_BUCKETS];
+	atomic_t	lat_busy[GD25Q_BUSY_CE + 1][GD25Q_LAT_BUCKETS];	//按gd25q_busy_op分
+};
+
 /* Bit masks for spi_device.mode management.  Note that incorrect
  * settings for some settings can cause *lots* of trouble for other
  * devices on a shared bus:
@@ -82,32 +278,402 @@ struct spidev_data {
 	struct spi_device	*spi;
 	struct list_head	device_entry;
 
+	/*
+	 * buf_lock：读(read、mmap缺页、mtd读)拿读锁，可以同时有几个；
+	 * 写、擦除、ioctl拿写锁，tx/rx缓冲区只在写锁下用。
+	 * 拿读锁的时候，芯片的命令序列(等空闲、暂停擦除、读命令)用io_lock串行，
+	 * 扇区缓存和mmap的页用cache_lock保护。顺序：buf_lock -> io_lock -> cache_lock。
+	 */
+	struct rw_semaphore	buf_lock;
+	struct mutex		io_lock;
+	struct mutex		cache_lock;
+
 	/* TX/RX buffers are NULL unless this device is open (users > 0) */
-	struct mutex		buf_lock;
 	unsigned		users;
 	u8			*tx_buffer;
 	u8			*rx_buffer;
 	u32			speed_hz;
-	unsigned int cur_addr;
 	unsigned wp_gpio;
 	unsigned int flash_id;
 	unsigned int flash_size;
-	ssize_t sector_offset;   //扇区内的偏移
+	unsigned read_mode;      //GD25QXX_READ_xxx，AUTO表示自动选择
+	const struct gd25q_read_op *read_op;   //当前实际使用的读命令，指向read_ops
+	u8 addr_width;                         //命令里的地址字节数，3或4
+	u8 pp_opcode;                          //页编程命令，4字节命令模式下是0x12
+	struct gd25q_read_op read_ops[GD25QXX_READ_MODE_MAX + 1];
+	struct gd25q_busy_timing busy_timing[GD25Q_BUSY_CE + 1];
+	struct gd25qxx_geometry geo;           //probe时从SFDP/ID表/dts得到的参数
+	enum gd25q_busy_op busy_op;            //正在等待完成的操作，GD25Q_IDLE表示空闲
+	unsigned int busy_addr, busy_len;      //这个操作的范围和开始时间，trace用
+	ktime_t busy_start;
+	//擦除暂停，见gd25q_read_begin
+	u8 suspend_opcode, resume_opcode;      //0表示芯片不支持暂停
+	unsigned int suspend_interval_us;      //芯片要求的恢复到下一次暂停的最小间隔
+	unsigned int suspend_count;            //当前擦除已经暂停的次数
+	ktime_t resume_time;                   //当前擦除最后一次开始/恢复的时间
+	u64 suspended_ns;                      //当前擦除暂停的总时间
+	struct mtd_info mtd;                   //同时注册成mtd设备
+	bool mtd_registered;
+	struct list_head cache_lru;            //扇区缓存，最近用的在前面
+	unsigned int cache_count;
+	struct page **mmap_pages;              //mmap用的页，按flash的页号索引，第一次mmap时分配
+	unsigned long mmap_npages;
+	struct inode *mmap_inode;              //做mmap的设备节点，写和擦除时要解除映射
+	struct gd25q_stats stats;
+	struct dentry *debugfs;
+	u32 *wear;                             //每个扇区的擦除次数
+	unsigned int wear_sectors;
+	unsigned int wear_offset, wear_size;   //保存擦除次数的flash区域，wear_size为0表示不保存
+	unsigned int wear_slot, wear_next;     //区域里每条记录占的字节数，下一条记录写在第几个位置
+	bool wear_dirty;
+	struct delayed_work wear_work;
+	struct debugfs_blob_wrapper wear_blob;
+	//顺序写的预擦除，见gd25q_stream_write
+	struct file *stream_owner;             //用GD25QXX_IOC_STREAM_BEGIN声明区域的fd
+	unsigned int stream_start, stream_end; //声明的区域，stream_end为0表示没有
+	unsigned int stream_pos;               //下一次顺序写的地址
+	unsigned int stream_erased;            //[stream_pos, stream_erased)已经擦除，还没写
+	struct work_struct stream_work;
+	//异步擦除任务，同时只有一个，见GD25QXX_IOC_ERASE_ASYNC
+	struct work_struct erase_work;
+	wait_queue_head_t erase_wait;          //任务结束时唤醒poll
+	struct eventfd_ctx *erase_eventfd;
+	u32 erase_id;                          //最近一个任务的id，从1开始
+	unsigned int erase_addr, erase_len, erase_done;
+	int erase_status;                      //-EINPROGRESS正在做，0完成，负数出错
+	ktime_t erase_start, erase_end;
+	unsigned long *blank;                  //已知空白的扇区，一个扇区一位，见gd25q_blank
+	unsigned int blank_sectors;
+	//正在进行的范围擦除(范围擦除的ioctl、mtd擦除、异步擦除)，见gd25q_wait_wipe
+	unsigned int wipe_start, wipe_end;     //wipe_end为0表示没有
+	wait_queue_head_t wipe_wait;
 };
 
 static LIST_HEAD(device_list);
 static DEFINE_MUTEX(device_list_lock);
 
+//aio和顺序写预擦除用的工作队列
+static struct workqueue_struct *gd25q_wq;
+
 static unsigned bufsiz = 4096;
 module_param(bufsiz, uint, S_IRUGO);
 MODULE_PARM_DESC(bufsiz, "data bytes in biggest supported SPI message");
 
+static unsigned read_mode = GD25QXX_READ_AUTO;
+module_param(read_mode, uint, S_IRUGO);
+MODULE_PARM_DESC(read_mode, "0=auto 1=normal(0x03) 2=fast(0x0B) 3=dual(0x3B) 4=quad(0x6B) 5=quad-io(0xEB)");
+
+static unsigned cache_sectors = 16;
+module_param(cache_sectors, uint, S_IRUGO);
+MODULE_PARM_DESC(cache_sectors, "4KB sectors cached per device, 0 to disable");
+
+static unsigned direct_min = 16384;
+module_param(direct_min, uint, S_IRUGO);
+MODULE_PARM_DESC(direct_min, "reads of at least this many bytes go straight into user pages, 0 to disable");
+
+static unsigned wear_save_interval = 3600;
+module_param(wear_save_interval, uint, S_IRUGO);
+MODULE_PARM_DESC(wear_save_interval, "seconds between saving erase counters to the wear-offset region, 0 to save only on remove");
+
+static unsigned erase_suspend_max = 16;
+module_param(erase_suspend_max, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(erase_suspend_max, "times one sector/block erase may be suspended for reads, 0 to disable");
+
+static unsigned erase_suspend_interval = 1000;
+module_param(erase_suspend_interval, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(erase_suspend_interval, "microseconds an erase runs after start/resume before it may be suspended again");
+
+static unsigned erase_ahead = 262144;
+module_param(erase_ahead, uint, S_IRUGO);
+MODULE_PARM_DESC(erase_ahead, "bytes a declared write stream is erased ahead of the writer, 0 to disable");
+
+/*-------------------------------------------------------------------------*/
+
+/*
+ * 扇区缓存：最近用到的4KB扇区按LRU保存，读命中不走总线，
+ * 改写扇区的一部分时也不用再把扇区读出来。
+ * 擦除和页编程成功后同步更新缓存的内容，和flash保持一致。
+ * 链表和内容由cache_lock保护，读flash的时候不拿cache_lock。
+ */
+struct gd25q_cache_entry {
+	struct list_head	lru;
+	unsigned int		addr;	//扇区首地址
+	u8			*data;
+};
+
+static struct gd25q_cache_entry *
+gd25q_cache_lookup(struct spidev_data *spidev, unsigned int addr)
+{
+	struct gd25q_cache_entry *e;
+
+	list_for_each_entry(e, &spidev->cache_lru, lru) {
+		if (e->addr == addr) {
+			list_move(&e->lru, &spidev->cache_lru);
+			return e;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * 把读好的一个扇区放到缓存最前面，没满就新建一项，满了就换掉最久没用的那个。
+ * data之后归缓存管理。
+ */
+static void gd25q_cache_insert(struct spidev_data *spidev, unsigned int addr, u8 *data)
+{
+	struct gd25q_cache_entry *e = NULL;
+
+	if (spidev->cache_count < cache_sectors) {
+		e = kmalloc(sizeof(*e), GFP_KERNEL);
+		if (e)
+			spidev->cache_count++;
+	}
+	if (!e) {
+		if (list_empty(&spidev->cache_lru)) {
+			kfree(data);
+			return;
+		}
+		e = list_last_entry(&spidev->cache_lru,
+				struct gd25q_cache_entry, lru);
+		list_del(&e->lru);
+		kfree(e->data);
+	}
+
+	e->addr = addr;
+	e->data = data;
+	list_add(&e->lru, &spidev->cache_lru);
+}
+
+static void gd25q_cache_drop(struct spidev_data *spidev,
+		struct gd25q_cache_entry *e)
+{
+	list_del(&e->lru);
+	kfree(e->data);
+	kfree(e);
+	spidev->cache_count--;
+}
+
+static void gd25q_cache_flush(struct spidev_data *spidev)
+{
+	struct gd25q_cache_entry *e, *tmp;
+
+	mutex_lock(&spidev->cache_lock);
+	list_for_each_entry_safe(e, tmp, &spidev->cache_lru, lru)
+		gd25q_cache_drop(spidev, e);
+	mutex_unlock(&spidev->cache_lock);
+}
+
+//[addr, addr+len)已经擦除，缓存里的这些扇区变成全0xff
+static void gd25q_cache_erase(struct spidev_data *spidev,
+		unsigned int addr, unsigned int len)
+{
+	struct gd25q_cache_entry *e;
+
+	list_for_each_entry(e, &spidev->cache_lru, lru) {
+		if (e->addr >= addr && e->addr - addr < len)
+			memset(e->data, 0xff, GD25QXX_SECTOR);
+	}
+}
+
+//编程只能把1变成0，缓存里的内容和写入的数据按位与
+static void gd25q_cache_program(struct spidev_data *spidev,
+		unsigned int addr, const u8 *buf, size_t len)
+{
+	struct gd25q_cache_entry *e;
+	unsigned int start, end, i;
+
+	list_for_each_entry(e, &spidev->cache_lru, lru) {
+		if (addr + len <= e->addr || addr >= e->addr + GD25QXX_SECTOR)
+			continue;
+		start = max(addr, e->addr);
+		end = min_t(unsigned int, addr + len, e->addr + GD25QXX_SECTOR);
+		for (i = start; i < end; i++)
+			e->data[i - e->addr] &= buf[i - addr];
+	}
+}
+
+/*
+ * flash的[addr, addr+len)内容变了，mmap读进来的页都作废：
+ * 先解除用户空间的映射，再释放页，下次访问重新从flash读。
+ */
+static void gd25q_mmap_invalidate(struct spidev_data *spidev,
+		unsigned int addr, unsigned int len)
+{
+	unsigned long first, last, i;
+
+	if (!spidev->mmap_pages || !len)
+		return;
+
+	first = addr >> PAGE_SHIFT;
+	last = min_t(unsigned long, (addr + (len - 1)) >> PAGE_SHIFT,
+			spidev->mmap_npages - 1);
+	for (i = first; i <= last; i++) {
+		if (!spidev->mmap_pages[i])
+			continue;
+		unmap_mapping_range(spidev->mmap_inode->i_mapping,
+				(loff_t)i << PAGE_SHIFT, PAGE_SIZE, 1);
+		put_page(spidev->mmap_pages[i]);
+		spidev->mmap_pages[i] = NULL;
+	}
+}
+
+/*
+ * 最后一个用户关闭时调用，这时已经没有映射了。
+ * 但MTD的写/擦除、后台擦除、预擦除worker、wear_work还可能在gd25q_mmap_invalidate()里用这些指针，
+ * 所以拿着buf_lock写锁和cache_lock把指针摘下来清零，放开锁以后再释放。
+ */
+static void gd25q_mmap_free(struct spidev_data *spidev)
+{
+	struct page **pages;
+	struct inode *inode;
+	unsigned long i, npages;
+
+	down_write(&spidev->buf_lock);
+	mutex_lock(&spidev->cache_lock);
+	pages = spidev->mmap_pages;
+	npages = spidev->mmap_npages;
+	inode = spidev->mmap_inode;
+	spidev->mmap_pages = NULL;
+	spidev->mmap_npages = 0;
+	spidev->mmap_inode = NULL;
+	mutex_unlock(&spidev->cache_lock);
+	up_write(&spidev->buf_lock);
+
+	if (!pages)
+		return;
+
+	for (i = 0; i < npages; i++)
+		if (pages[i])
+			put_page(pages[i]);
+	vfree(pages);
+	iput(inode);
+}
+
+//每个被擦除的扇区擦除次数加1
+static void gd25q_wear_erased(struct spidev_data *spidev,
+		unsigned int addr, unsigned int len)
+{
+	unsigned int i = addr / GD25QXX_SECTOR;
+	unsigned int end = min((addr + len) / GD25QXX_SECTOR, spidev->wear_sectors);
+
+	if (!spidev->wear)
+		return;
+	for ( ; i < end; i++)
+		spidev->wear[i]++;
+	spidev->wear_dirty = true;
+}
+
+/*
+ * 已知空白(全0xff)的扇区，一个扇区一位，驱动加载时全是0(不知道)。
+ * 擦除置位，编程了非0xff的数据清零，读整个扇区(扇区缓存、GD25QXX_IOC_BLANK_CHECK)时顺便更新。
+ * 写已知空白的扇区不用读出来判断，擦除已知空白的扇区直接跳过。
+ * bitmap_set/bitmap_clear只在buf_lock写锁下用，读锁下只用set_bit/clear_bit。
+ */
+static bool gd25q_blank(struct spidev_data *spidev, unsigned int addr, unsigned int len)
+{
+	unsigned int end = DIV_ROUND_UP(addr + len, GD25QXX_SECTOR);
+
+	if (!spidev->blank || !len)
+		return false;
+	return find_next_zero_bit(spidev->blank, end, addr / GD25QXX_SECTOR) >= end;
+}
+
+//读到了addr开始的整个扇区，返回是不是空白
+static bool gd25q_blank_note(struct spidev_data *spidev, unsigned int addr, const u8 *data)
+{
+	bool blank = !memchr_inv(data, 0xff, GD25QXX_SECTOR);
+
+	if (!spidev->blank)
+		return blank;
+	if (blank)
+		set_bit(addr / GD25QXX_SECTOR, spidev->blank);
+	else
+		clear_bit(addr / GD25QXX_SECTOR, spidev->blank);
+	return blank;
+}
+
+//停止顺序写的预擦除，已经擦掉的部分不恢复
+static void gd25q_stream_stop(struct spidev_data *spidev)
+{
+	spidev->stream_end = 0;
+	spidev->stream_owner = NULL;
+}
+
+//擦除、页编程命令发出后调用，保持缓存、mmap的页、空白位图与flash一致
+static void gd25q_flash_erased(struct spidev_data *spidev,
+		unsigned int addr, unsigned int len)
+{
+	if (spidev->blank)
+		bitmap_set(spidev->blank, addr / GD25QXX_SECTOR, len / GD25QXX_SECTOR);
+	mutex_lock(&spidev->cache_lock);
+	gd25q_cache_erase(spidev, addr, len);
+	gd25q_mmap_invalidate(spidev, addr, len);
+	mutex_unlock(&spidev->cache_lock);
+	gd25q_wear_erased(spidev, addr, len);
+}
+
+static void gd25q_flash_programmed(struct spidev_data *spidev,
+		unsigned int addr, const u8 *buf, size_t len)
+{
+	mutex_lock(&spidev->cache_lock);
+	gd25q_cache_program(spidev, addr, buf, len);
+	gd25q_mmap_invalidate(spidev, addr, len);
+	mutex_unlock(&spidev->cache_lock);
+	//别的写(mtd、别的fd)写进了预擦除过的地方，不能再当成已擦除
+	if (spidev->stream_end && addr < spidev->stream_erased &&
+	    addr + len > spidev->stream_pos)
+		gd25q_stream_stop(spidev);
+}
+
 /*-------------------------------------------------------------------------*/
 
-static char spi_gd25q_status(struct spi_device *spi)
+//记录芯片开始忙的操作，wait_ready里算出这个操作实际用了多长时间
+static void gd25q_set_busy(struct spidev_data *spidev, enum gd25q_busy_op op,
+		unsigned int addr, unsigned int len)
+{
+	spidev->busy_op = op;
+	spidev->busy_addr = addr;
+	spidev->busy_len = len;
+	spidev->busy_start = ktime_get();
+	spidev->suspend_count = 0;
+	spidev->resume_time = spidev->busy_start;
+	spidev->suspended_ns = 0;
+}
+
+/*
+ * 等芯片完成失败(超时或者读状态出错)：操作不知道有没有做完，缓存的内容不可信了。
+ * 擦除命令发出时gd25q_flash_erased已经把范围记成空白，这里去掉，
+ * 不然没擦完的扇区以后会跳过擦除直接编程。
+ */
+static void gd25q_busy_failed(struct spidev_data *spidev)
+{
+	unsigned int i, end;
+
+	//读的时候(gd25q_read_begin)也会走到这里，只拿着buf_lock读锁，别的读在改同一个字，只能逐位清
+	if (spidev->blank && spidev->busy_op >= GD25Q_BUSY_SE && spidev->busy_len) {
+		end = DIV_ROUND_UP(spidev->busy_addr + spidev->busy_len, GD25QXX_SECTOR);
+		for (i = spidev->busy_addr / GD25QXX_SECTOR; i < end; i++)
+			clear_bit(i, spidev->blank);
+	}
+	gd25q_cache_flush(spidev);
+}
+
+static inline u64 gd25q_ns_since(ktime_t start)
+{
+	return ktime_to_ns(ktime_sub(ktime_get(), start));
+}
+
+static void gd25q_lat_add(atomic_t *hist, u64 ns)
+{
+	u64 us = div_u64(ns, NSEC_PER_USEC);
+
+	atomic_inc(&hist[min_t(unsigned int, fls64(us), GD25Q_LAT_BUCKETS - 1)]);
+}
+
+static int spi_gd25q_read_reg(struct spi_device *spi, u8 opcode)
 {       
 	int     status;
-	char tbuf[]={READ_STATUS_REG};
+	char tbuf[]={opcode};
 	char rbuf[1] = {1};
 	struct spi_transfer     t = {
 		.tx_buf         = tbuf,
@@ -124,29 +690,159 @@ static char spi_gd25q_status(struct spi_device *spi)
 	spi_message_add_tail(&t, &m);
 	spi_message_add_tail(&r, &m);
 	status = spi_sync(spi, &m);
+	if (status < 0)
+		return status;
 
-	return rbuf[0];
-}
-//modified by xzq degain for retry 5 times @20211105
-static int spi_gd25q_wait_ready(struct spi_device *spi )
-{
-	char retval = 1;
-	int retry = 5;
-	dev_dbg(&spi->dev, "wait ready...");
-	do {
-		retval = spi_gd25q_status(spi);
-		retval &= 0xff;
-		retval &= 1;
-		retry --;
-		mdelay(5);
-	}while((retval != 0) && (retry != 0));
-	if(retval)
-		dev_err(&spi->dev,"no ready\n");
-	else
-		dev_dbg(&spi->dev, "OK\n");
+	return (u8)rbuf[0];
+}
+
+/*
+ * 等待上一个写/擦除操作完成。空闲的时候直接返回，
+ * 否则按操作类型睡眠查询WIP位，超时返回-ETIMEDOUT。
+ */
+static int spi_gd25q_wait_ready(struct spidev_data *spidev)
+{
+	struct spi_device *spi = spidev->spi;
+	const struct gd25q_busy_timing *tm;
+	unsigned long deadline;
+	unsigned int polls = 0;
+	bool expired;
+	u64 ns;
+	int sr;
+
+	if (spidev->busy_op == GD25Q_IDLE)
+		return 0;
+
+	tm = &spidev->busy_timing[spidev->busy_op];
+	deadline = jiffies + msecs_to_jiffies(tm->timeout_ms);
+	dev_dbg(&spi->dev, "wait %s...\n", tm->name);
+	for (;;) {
+		//先取时间再读状态，睡眠被拖长也会再查一次才判超时
+		expired = time_after(jiffies, deadline);
+		sr = spi_gd25q_read_reg(spi, READ_STATUS_REG);
+		polls++;
+		if (sr < 0) {
+			gd25q_busy_failed(spidev);
+			return sr;
+		}
+		if (!(sr & STATUS_WIP))
+			break;
+		if (expired) {
+			dev_err(&spi->dev, "%s timeout\n", tm->name);
+			trace_gd25q_wait_ready(tm->name, spidev->busy_addr,
+				spidev->busy_len, gd25q_ns_since(spidev->busy_start),
+				polls, -ETIMEDOUT);
+			atomic64_add(polls, &spidev->stats.status_polls);
+			gd25q_busy_failed(spidev);
+			return -ETIMEDOUT;
+		}
+		if (tm->poll_us >= 20000)
+			msleep(tm->poll_us / 1000);
+		else
+			usleep_range(tm->poll_us, tm->poll_us + tm->poll_us / 4);
+	}
+
+	ns = gd25q_ns_since(spidev->busy_start);
+	trace_gd25q_wait_ready(tm->name, spidev->busy_addr, spidev->busy_len,
+			ns, polls, 0);
+	atomic64_add(polls, &spidev->stats.status_polls);
+	gd25q_lat_add(spidev->stats.lat_busy[spidev->busy_op], ns);
+	spidev->busy_op = GD25Q_IDLE;
 	return 0;
 }
-//modified by xzq end
+/*
+ * 等擦除完成，等的时候放开buf_lock，读可以进来暂停擦除(gd25q_read_begin)。
+ * 调用者拿着buf_lock，并且缓冲区里没有放开锁以后还要用的数据。
+ * 超时(不算暂停的时间)以后交给spi_gd25q_wait_ready报错。
+ */
+static int spi_gd25q_wait_erase(struct spidev_data *spidev)
+{
+	const struct gd25q_busy_timing *tm;
+	int sr;
+
+	while (spidev->busy_op >= GD25Q_BUSY_SE) {
+		tm = &spidev->busy_timing[spidev->busy_op];
+		if (gd25q_ns_since(spidev->busy_start) - spidev->suspended_ns >
+		    (u64)tm->timeout_ms * NSEC_PER_MSEC)
+			break;
+		sr = spi_gd25q_read_reg(spidev->spi, READ_STATUS_REG);
+		atomic64_inc(&spidev->stats.status_polls);
+		if (sr < 0) {
+			gd25q_busy_failed(spidev);
+			return sr;
+		}
+		if (!(sr & STATUS_WIP))
+			break;
+		up_write(&spidev->buf_lock);
+		if (tm->poll_us >= 20000)
+			msleep(tm->poll_us / 1000);
+		else
+			usleep_range(tm->poll_us, tm->poll_us + tm->poll_us / 4);
+		down_write(&spidev->buf_lock);
+	}
+	return spi_gd25q_wait_ready(spidev);
+}
+
+/*
+ * 读之前调用。芯片正在做扇区/块擦除、并且读的不是正在擦除的地方时，
+ * 暂停擦除(0x75)，读完用gd25q_read_end恢复(0x7A)，读不用等几百毫秒的擦除。
+ * 整片擦除不能暂停，只能等。
+ * 防止擦除饿死：一次擦除最多暂停erase_suspend_max次，开始或恢复以后
+ * 至少让擦除跑erase_suspend_interval微秒(不小于芯片要求的间隔)才能再暂停，
+ * 不满足就等擦除做完。
+ * 返回1表示暂停了擦除，0表示芯片空闲，负数是错误。
+ */
+static int gd25q_read_begin(struct spidev_data *spidev, unsigned int addr, size_t len)
+{
+	struct spi_device *spi = spidev->spi;
+	u8 cmd = spidev->suspend_opcode;
+	unsigned int interval = max(erase_suspend_interval, spidev->suspend_interval_us);
+	int i, sr;
+
+	if (spidev->busy_op != GD25Q_BUSY_SE && spidev->busy_op != GD25Q_BUSY_BE32 &&
+	    spidev->busy_op != GD25Q_BUSY_BE64)
+		return spi_gd25q_wait_ready(spidev);
+	if (!cmd || spidev->suspend_count >= erase_suspend_max ||
+	    (addr < spidev->busy_addr + spidev->busy_len &&
+	     addr + len > spidev->busy_addr) ||
+	    ktime_us_delta(ktime_get(), spidev->resume_time) < interval)
+		return spi_gd25q_wait_ready(spidev);
+
+	sr = spi_write_then_read(spi, &cmd, 1, NULL, 0);
+	if (sr)
+		return sr;
+	spidev->suspend_count++;
+	spidev->resume_time = ktime_get();   //暂停的开始时间，恢复时更新
+	//tSUS最多几十微秒，WIP清零以后才能读
+	for (i = 0; i < 100; i++) {
+		sr = spi_gd25q_read_reg(spi, READ_STATUS_REG);
+		if (sr < 0 || !(sr & STATUS_WIP))
+			break;
+		usleep_range(10, 20);
+	}
+	if (sr >= 0 && !(sr & STATUS_WIP)) {
+		atomic64_inc(&spidev->stats.erase_suspends);
+		return 1;
+	}
+	//没有暂停成功，恢复以后等擦除做完
+	cmd = spidev->resume_opcode;
+	spi_write_then_read(spi, &cmd, 1, NULL, 0);
+	return sr < 0 ? sr : spi_gd25q_wait_ready(spidev);
+}
+
+static int gd25q_read_end(struct spidev_data *spidev, int suspended)
+{
+	u8 cmd = spidev->resume_opcode;
+	ktime_t now;
+
+	if (suspended <= 0)
+		return 0;
+	now = ktime_get();
+	spidev->suspended_ns += ktime_to_ns(ktime_sub(now, spidev->resume_time));
+	spidev->resume_time = now;
+	return spi_write_then_read(spidev->spi, &cmd, 1, NULL, 0);
+}
+
 static int spi_gd25q_write_enable(struct spi_device *spi)
 {       
 	int     status;
@@ -172,7 +868,7 @@ static int spi_read_gd25q_id_0(struct spi_device *spi)
 {       
 	int     status;
 	char tbuf[]={READ_UID};
-	char rbuf[3];
+	unsigned char rbuf[3];
 
 	struct spi_transfer     t = {
 		.tx_buf         = tbuf,
@@ -196,95 +892,226 @@ static int spi_read_gd25q_id_0(struct spi_device *spi)
 	return (rbuf[0]<<16| rbuf[1]<<8 | rbuf[2]);
 }
 
-static int
-spi_gd25q_sector_erase(struct spidev_data *spidev, unsigned long size)
+//QE位是非易失的，只有真正要用四线读的时候才去写状态寄存器
+static int spi_gd25q_quad_enable(struct spidev_data *spidev)
 {
-	int status;
-	char cmd[4] = {SECTOR_ERASE};
 	struct spi_device *spi = spidev->spi;
-	struct spi_transfer t = {
-		.tx_buf = cmd,
-		.len = ARRAY_SIZE(cmd),
+	int status;
+	int sr1, sr2;
+	char cmd_buf[3] = {WRITE_STATUS_REG};
+	struct spi_transfer cmd = {
+		.tx_buf = cmd_buf,
+		.len = ARRAY_SIZE(cmd_buf),
 	};
-	struct spi_message m;
-	unsigned int flash_addr = spidev->cur_addr;
-	int count = (int)size;
-	printk("spi_gd25q_sector_erase flash_addr = %u\n",flash_addr);
-
-	for ( ; count > 0; count -= GD25QXX_SECTOR) {
-		cmd[1] = (unsigned char)((flash_addr & 0xff0000) >> 16);
-		cmd[2] = (unsigned char)((flash_addr & 0xff00) >> 8);
-		cmd[3] = (unsigned char)(flash_addr & 0xff);
-
-		spi_gd25q_write_enable(spi);
-
-		spi_message_init(&m);
-		spi_message_add_tail(&t, &m);
-		spi_gd25q_wait_ready(spi);
-		status = spi_sync(spi, &m);
-		
-		dev_info(&spi->dev,"start addr: %x, sector erase OK\n", flash_addr);
-		flash_addr += GD25QXX_SECTOR;
+	struct spi_message      m;
+
+	status = spi_gd25q_wait_ready(spidev);
+	if (status)
+		return status;
+
+	sr2 = spi_gd25q_read_reg(spi, READ_STATUS_REG2);
+	if (sr2 < 0)
+		return sr2;
+	if (sr2 & STATUS2_QE)
+		return 0;
+
+	sr1 = spi_gd25q_read_reg(spi, READ_STATUS_REG);
+	if (sr1 < 0)
+		return sr1;
+
+	//0x01 后面跟 S7-S0 S15-S8
+	cmd_buf[1] = (char)sr1;
+	cmd_buf[2] = (char)(sr2 | STATUS2_QE);
+
+	spi_gd25q_write_enable(spi);
+
+	spi_message_init(&m);
+	spi_message_add_tail(&cmd, &m);
+	status = spi_sync(spi, &m);
+	if (status < 0)
+		return status;
+	gd25q_set_busy(spidev, GD25Q_BUSY_WRSR, 0, 0);
+	status = spi_gd25q_wait_ready(spidev);
+	if (status)
+		return status;
+
+	sr2 = spi_gd25q_read_reg(spi, READ_STATUS_REG2);
+	if (sr2 < 0)
+		return sr2;
+	if (!(sr2 & STATUS2_QE)) {
+		dev_err(&spi->dev, "set QE bit failed, sr2 = %#x\n", sr2);
+		return -EIO;
 	}
-	return status;
+	dev_info(&spi->dev, "QE bit set\n");
+	return 0;
+}
+
+/*
+ * 选择读命令。AUTO时按控制器支持的线宽(spi->mode里的SPI_RX_DUAL/SPI_RX_QUAD，
+ * 来自dts的spi-rx-bus-width)和QE位来选，QE没置位就不用四线。
+ * 指定模式时，四线模式会去置QE位。
+ * wp-gpio有效时WP脚由GPIO驱动，不能当IO2用，所以不用四线。
+ */
+static int spi_gd25q_set_read_mode(struct spidev_data *spidev, unsigned mode)
+{
+	struct spi_device *spi = spidev->spi;
+	bool quad_ok = (spi->mode & SPI_RX_QUAD) &&
+			spidev->wp_gpio == INVALID_GPIO_PIN;
+	unsigned sel = mode;
+	int status;
+
+	const struct gd25q_read_op *ops = spidev->read_ops;
+
+	if (mode > GD25QXX_READ_MODE_MAX)
+		return -EINVAL;
+	if (mode != GD25QXX_READ_AUTO && !ops[mode].opcode)
+		return -EOPNOTSUPP;   //SFDP说芯片不支持
+
+	switch (mode) {
+	case GD25QXX_READ_AUTO:
+		sel = GD25QXX_READ_FAST;
+		if ((spi->mode & (SPI_RX_DUAL | SPI_RX_QUAD)) &&
+		    ops[GD25QXX_READ_DUAL].opcode)
+			sel = GD25QXX_READ_DUAL;
+		status = quad_ok ? spi_gd25q_wait_ready(spidev) : -EOPNOTSUPP;
+		if (status == 0)
+			status = spi_gd25q_read_reg(spi, READ_STATUS_REG2);
+		if (status > 0 && (status & STATUS2_QE)) {
+			if (ops[GD25QXX_READ_QUAD].opcode)
+				sel = GD25QXX_READ_QUAD;
+			if ((spi->mode & SPI_TX_QUAD) && ops[GD25QXX_READ_QUAD_IO].opcode)
+				sel = GD25QXX_READ_QUAD_IO;
+		}
+		break;
+	case GD25QXX_READ_QUAD_IO:
+		if (!(spi->mode & SPI_TX_QUAD))
+			return -EOPNOTSUPP;
+		/* fall through */
+	case GD25QXX_READ_QUAD:
+		if (!quad_ok)
+			return -EOPNOTSUPP;
+		status = spi_gd25q_quad_enable(spidev);
+		if (status)
+			return status;
+		break;
+	case GD25QXX_READ_DUAL:
+		if (!(spi->mode & (SPI_RX_DUAL | SPI_RX_QUAD)))
+			return -EOPNOTSUPP;
+		break;
+	default:
+		break;
+	}
+
+	spidev->read_mode = mode;
+	spidev->read_op = &ops[sel];
+	dev_info(&spi->dev, "read mode: %s (opcode %#x)\n",
+		spidev->read_op->name, spidev->read_op->opcode);
+	return 0;
+}
+
+//把地址按addr_width个字节(高字节在前)放到buf里，返回字节数
+static unsigned int gd25q_put_addr(struct spidev_data *spidev, u8 *buf,
+		unsigned int addr)
+{
+	unsigned int i, n = spidev->addr_width;
+
+	for (i = 0; i < n; i++)
+		buf[i] = addr >> (8 * (n - 1 - i));
+	return n;
+}
+
+//按擦除大小找命令码，0表示芯片不支持这个大小
+static u8 gd25q_erase_opcode(struct spidev_data *spidev, unsigned int size)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(spidev->geo.erase); i++)
+		if (spidev->geo.erase[i].size == size)
+			return spidev->geo.erase[i].opcode;
+	return 0;
 }
 
+/*
+ * 发一条带地址的擦除命令，size是4KB/32KB/64KB，命令码按probe时得到的擦除类型。
+ * 芯片忙的时候写使能是无效的，所以先等空闲。
+ */
 static int
-spi_gd25q_32kb_block_erase(struct spidev_data *spidev)
+spi_gd25q_erase_cmd(struct spidev_data *spidev, unsigned int size, unsigned int addr)
 {
 	int status;
-	char cmd[4] = {BLOCK_32KB_ERASE};
+	u8 opcode = gd25q_erase_opcode(spidev, size);
+	u8 cmd[5] = {opcode};
 	struct spi_device *spi = spidev->spi;
+	ktime_t start;
 	struct spi_transfer t = {
 		.tx_buf = cmd,
-		.len = ARRAY_SIZE(cmd),
 	};
 	struct spi_message m;
 
-	cmd[1] = (unsigned char)((spidev->cur_addr & 0xff0000) >> 16);
-	cmd[2] = (unsigned char)((spidev->cur_addr & 0xff00) >> 8);
-	cmd[3] = (unsigned char)(spidev->cur_addr & 0xff);
+	if (!opcode)
+		return -EOPNOTSUPP;
+	//地址不对齐时芯片擦除的是地址所在的整个单元
+	addr &= ~(size - 1);
+	if (gd25q_blank(spidev, addr, size)) {
+		atomic64_inc(&spidev->stats.blank_skips);
+		return 0;
+	}
+	t.len = 1 + gd25q_put_addr(spidev, &cmd[1], addr);
+
+	status = spi_gd25q_wait_ready(spidev);
+	if (status)
+		return status;
 
+	start = ktime_get();
 	spi_gd25q_write_enable(spi);
 
 	spi_message_init(&m);
 	spi_message_add_tail(&t, &m);
-	spi_gd25q_wait_ready(spi);
 	status = spi_sync(spi, &m);
-	
-	dev_dbg(&spi->dev,"32kb block erase OK\n");
+	trace_gd25q_erase(opcode, addr, size, gd25q_ns_since(start), status);
+	if (status < 0)
+		return status;
+
+	if (size == GD25QXX_64KB_BLOCK) {
+		gd25q_set_busy(spidev, GD25Q_BUSY_BE64, addr, size);
+		atomic64_inc(&spidev->stats.block64_erases);
+	} else if (size == GD25QXX_32KB_BLOCK) {
+		gd25q_set_busy(spidev, GD25Q_BUSY_BE32, addr, size);
+		atomic64_inc(&spidev->stats.block32_erases);
+	} else {
+		gd25q_set_busy(spidev, GD25Q_BUSY_SE, addr, size);
+		atomic64_inc(&spidev->stats.sector_erases);
+	}
+	gd25q_flash_erased(spidev, addr, size);
+
 	return status;
 }
 
 static int
-spi_gd25q_64kb_block_erase(struct spidev_data *spidev)
+spi_gd25q_32kb_block_erase(struct spidev_data *spidev, unsigned int addr)
 {
 	int status;
-	char cmd[4] = {BLOCK_64KB_ERASE};
-	struct spi_device *spi = spidev->spi;
-	struct spi_transfer t = {
-		.tx_buf = cmd,
-		.len = ARRAY_SIZE(cmd),
-	};
-	struct spi_message m;
 
-	cmd[1] = (unsigned char)((spidev->cur_addr & 0xff0000) >> 16);
-	cmd[2] = (unsigned char)((spidev->cur_addr & 0xff00) >> 8);
-	cmd[3] = (unsigned char)(spidev->cur_addr & 0xff);
+	status = spi_gd25q_erase_cmd(spidev, GD25QXX_32KB_BLOCK, addr);
+	
+	dev_dbg(&spidev->spi->dev,"32kb block erase OK\n");
+	return status;
+}
 
-	spi_gd25q_write_enable(spi);
+static int
+spi_gd25q_64kb_block_erase(struct spidev_data *spidev, unsigned int addr)
+{
+	int status;
 
-	spi_message_init(&m);
-	spi_message_add_tail(&t, &m);
-	spi_gd25q_wait_ready(spi);
-	status = spi_sync(spi, &m);
+	status = spi_gd25q_erase_cmd(spidev, GD25QXX_64KB_BLOCK, addr);
 	
-	dev_dbg(&spi->dev,"64kb block erase OK\n");
+	dev_dbg(&spidev->spi->dev,"64kb block erase OK\n");
 	return status;
 }
 
-static int spi_gd25q_chip_erase(struct spi_device *spi)
+static int spi_gd25q_chip_erase(struct spidev_data *spidev)
 {
+	struct spi_device *spi = spidev->spi;
 	int status;
 	char chip_erase[1] = {CHIP_ERASE};
 
@@ -293,57 +1120,305 @@ static int spi_gd25q_chip_erase(struct spi_device *spi)
 		.len = ARRAY_SIZE(chip_erase),
 	};
 	struct spi_message m;
+	ktime_t start;
 
-	spi_gd25q_write_enable(spi);
+	if (gd25q_blank(spidev, 0, spidev->flash_size)) {
+		atomic64_inc(&spidev->stats.blank_skips);
+		return 0;
+	}
+	status = spi_gd25q_wait_ready(spidev);
+	if (status)
+		return status;
+	start = ktime_get();
+	spi_gd25q_write_enable(spi);
 
 	spi_message_init(&m);
 	spi_message_add_tail(&erase, &m);
-	spi_gd25q_wait_ready(spi);
 	status = spi_sync(spi, &m);
+	trace_gd25q_erase(CHIP_ERASE, 0, spidev->flash_size,
+			gd25q_ns_since(start), status);
+	if (status < 0)
+		return status;
+	gd25q_set_busy(spidev, GD25Q_BUSY_CE, 0, spidev->flash_size);
+	atomic64_inc(&spidev->stats.chip_erases);
+	gd25q_flash_erased(spidev, 0, spidev->flash_size);
 	
 	dev_dbg(&spi->dev,"chip erase OK\n");
 	return status;
 }
 
-static loff_t
-spi_gd25q_llseek(struct file *filp, loff_t offset, int orig)
+//从addr开始，不超过end，芯片支持的最大擦除单元：64KB块 > 32KB块 > 4KB扇区
+static unsigned int spi_gd25q_erase_unit(struct spidev_data *spidev,
+		unsigned int addr, unsigned int end)
 {
-	loff_t ret = 0;
-	struct spidev_data	*spidev;
+	if (IS_ALIGNED(addr, GD25QXX_64KB_BLOCK) && end - addr >= GD25QXX_64KB_BLOCK &&
+	    gd25q_erase_opcode(spidev, GD25QXX_64KB_BLOCK))
+		return GD25QXX_64KB_BLOCK;
+	if (IS_ALIGNED(addr, GD25QXX_32KB_BLOCK) && end - addr >= GD25QXX_32KB_BLOCK &&
+	    gd25q_erase_opcode(spidev, GD25QXX_32KB_BLOCK))
+		return GD25QXX_32KB_BLOCK;
+	return GD25QXX_SECTOR;
+}
 
-	spidev = filp->private_data;
-	switch (orig) {
-	case SEEK_SET:
-		if (offset < 0) {
-			ret = -EINVAL;
-			break;
-		}
-		if ((unsigned int)offset > spidev->flash_size) {  //GD25QXX_SIZE
-			ret = -EINVAL;
+//擦除一个单元，返回擦除的字节数
+static int spi_gd25q_erase_step(struct spidev_data *spidev,
+		unsigned int addr, unsigned int end)
+{
+	unsigned int size = spi_gd25q_erase_unit(spidev, addr, end);
+	int status;
+
+	status = spi_gd25q_erase_cmd(spidev, size, addr);
+	if (status < 0)
+		return status;
+	return size;
+}
+
+//最小的擦除单元，范围擦除的地址和长度要按它对齐(probe时保证芯片有4KB擦除)
+static unsigned int gd25q_erase_granularity(struct spidev_data *spidev)
+{
+	unsigned int size = 0;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(spidev->geo.erase); i++)
+		if (spidev->geo.erase[i].size && spidev->geo.erase[i].opcode &&
+		    (!size || spidev->geo.erase[i].size < size))
+			size = spidev->geo.erase[i].size;
+	return size ? size : GD25QXX_SECTOR;
+}
+
+static bool gd25q_wipe_overlaps(struct spidev_data *spidev,
+		unsigned int addr, unsigned int len)
+{
+	return spidev->wipe_end && addr < spidev->wipe_end &&
+	       addr + len > spidev->wipe_start;
+}
+
+/*
+ * 范围擦除等擦除完成的时候放开了buf_lock，如果这时别人写进了还没擦到的地方，
+ * 写进去的数据会被后面的擦除擦掉。写和范围擦除开始之前调用(拿着buf_lock写锁)，
+ * 和正在进行的范围擦除重叠就放开锁等它做完。读不用等。
+ */
+static void gd25q_wait_wipe(struct spidev_data *spidev,
+		unsigned int addr, unsigned int len)
+{
+	while (gd25q_wipe_overlaps(spidev, addr, len)) {
+		up_write(&spidev->buf_lock);
+		wait_event(spidev->wipe_wait, !gd25q_wipe_overlaps(spidev, addr, len));
+		down_write(&spidev->buf_lock);
+	}
+}
+
+//同时只有一个范围擦除，调用时拿着buf_lock写锁
+static void gd25q_wipe_begin(struct spidev_data *spidev,
+		unsigned int addr, unsigned int len)
+{
+	gd25q_wait_wipe(spidev, 0, spidev->flash_size);
+	spidev->wipe_start = addr;
+	spidev->wipe_end = addr + len;
+}
+
+static void gd25q_wipe_end(struct spidev_data *spidev)
+{
+	spidev->wipe_end = 0;
+	wake_up_all(&spidev->wipe_wait);
+}
+
+/*
+ * 从flash_addr所在的扇区开始擦除size字节涉及的扇区，调用时拿着buf_lock写锁，返回时擦除已经完成。
+ * 等每个扇区擦除时放开buf_lock，所以和范围擦除一样把整段登记成正在擦除(gd25q_wipe_begin)，
+ * 别人写进这一段的要等全部擦完，不会写进去又被后面的扇区擦除擦掉。
+ */
+static int
+spi_gd25q_sector_erase(struct spidev_data *spidev, unsigned int flash_addr,
+		       unsigned long size)
+{
+	int status = 0;
+	unsigned int len;
+
+	flash_addr &= ~(GD25QXX_SECTOR-1);
+	if (flash_addr >= spidev->flash_size || size > spidev->flash_size - flash_addr)
+		return -EINVAL;
+	len = round_up(size, GD25QXX_SECTOR);
+
+	gd25q_wipe_begin(spidev, flash_addr, len);
+	for ( ; len > 0; len -= GD25QXX_SECTOR) {
+		status = spi_gd25q_wait_erase(spidev);   //上一个扇区擦除的时候可以读
+		if (status < 0)
 			break;
-		}
-		spidev->cur_addr = (unsigned int)offset;
-		ret = spidev->cur_addr;
-		break;
-	case SEEK_CUR:
-		if ((spidev->cur_addr + offset) > spidev->flash_size) {  //GD25QXX_SIZE
-			ret = -EINVAL;
+		status = spi_gd25q_erase_cmd(spidev, GD25QXX_SECTOR, flash_addr);
+		if (status < 0)
 			break;
+		flash_addr += GD25QXX_SECTOR;
+	}
+	if (status >= 0)
+		status = spi_gd25q_wait_erase(spidev);
+	gd25q_wipe_end(spidev);
+	return status;
+}
+
+/*
+ * 擦除[addr, addr+len)，用最少的命令：整个器件用整片擦除，
+ * 其余的先用对齐的64KB块，再用32KB块，两头剩下的用4KB扇区。
+ * addr和len都要按最小擦除单元对齐。
+ * yield为true时每个块擦除的时候放开buf_lock(spi_gd25q_wait_erase)，读可以插进来，
+ * 写进这个范围的要等整个范围擦完(gd25q_wait_wipe)，返回时擦除已经完成。
+ */
+static int spi_gd25q_erase_range(struct spidev_data *spidev,
+		unsigned int addr, unsigned int len, bool yield)
+{
+	unsigned int end, gran = gd25q_erase_granularity(spidev);
+	int status = 0;
+
+	if (!IS_ALIGNED(addr, gran) || !IS_ALIGNED(len, gran))
+		return -EINVAL;
+	if (addr > spidev->flash_size || len > spidev->flash_size - addr)
+		return -EINVAL;
+	if (!len)
+		return 0;
+
+	end = addr + len;
+	if (yield)
+		gd25q_wipe_begin(spidev, addr, len);
+
+	if (addr == 0 && len == spidev->flash_size) {
+		status = spi_gd25q_chip_erase(spidev);
+		addr = end;
+	}
+	while (status >= 0 && addr < end) {
+		if (yield) {
+			status = spi_gd25q_wait_erase(spidev);
+			if (status < 0)
+				break;
 		}
-		if ((spidev->cur_addr + offset) < 0) {
-			ret = -EINVAL;
+		status = spi_gd25q_erase_step(spidev, addr, end);
+		if (status >= 0)
+			addr += status;
+	}
+
+	if (yield) {
+		if (status >= 0)
+			status = spi_gd25q_wait_erase(spidev);
+		gd25q_wipe_end(spidev);
+	}
+	return status < 0 ? status : 0;
+}
+
+/*
+ * 异步擦除：ioctl检查完参数就返回任务id，擦除在工作队列里做，
+ * 每个块做完更新进度，结束时唤醒poll(POLLOUT)、通知eventfd。
+ * 等擦除的时候放开buf_lock，读可以进来(读会暂停擦除)，
+ * 写这个任务范围以外的地方也可以，写进范围里的要等任务结束。
+ */
+static void gd25q_erase_job_work(struct work_struct *work)
+{
+	struct spidev_data *spidev = container_of(work, struct spidev_data, erase_work);
+	unsigned int addr, end;
+	int status = 0;
+
+	down_write(&spidev->buf_lock);
+	if(spidev->wp_gpio != INVALID_GPIO_PIN)
+		gpio_set_value(spidev->wp_gpio, 1);
+
+	addr = spidev->erase_addr;
+	end = addr + spidev->erase_len;
+	gd25q_wipe_begin(spidev, addr, spidev->erase_len);
+	if (addr == 0 && end == spidev->flash_size) {
+		status = spi_gd25q_chip_erase(spidev);
+		if (status >= 0)
+			status = spi_gd25q_wait_erase(spidev);
+		if (status >= 0)
+			spidev->erase_done = spidev->erase_len;
+		addr = end;
+	}
+	while (status >= 0 && addr < end &&
+	       spidev->erase_status == -EINPROGRESS) {
+		status = spi_gd25q_erase_step(spidev, addr, end);
+		if (status < 0)
 			break;
-		}
-		spidev->cur_addr += offset;
-		ret = spidev->cur_addr;
-		break;
-	default:
-		ret =  - EINVAL;
-		break;
+		addr += status;
+		status = spi_gd25q_wait_erase(spidev);
+		if (status >= 0)
+			spidev->erase_done = addr - spidev->erase_addr;
+	}
+
+	gd25q_wipe_end(spidev);
+	if(spidev->wp_gpio != INVALID_GPIO_PIN)
+		gpio_set_value(spidev->wp_gpio, 0);
+	if (spidev->erase_status == -EINPROGRESS)   //remove的时候改成了-ECANCELED
+		spidev->erase_status = status < 0 ? status : 0;
+	spidev->erase_end = ktime_get();
+	if (spidev->erase_eventfd) {
+		eventfd_signal(spidev->erase_eventfd, 1);
+		eventfd_ctx_put(spidev->erase_eventfd);
+		spidev->erase_eventfd = NULL;
+	}
+	up_write(&spidev->buf_lock);
+	wake_up_interruptible(&spidev->erase_wait);
+}
+
+//拿着buf_lock调用，len为整个flash并且addr为0时用整片擦除
+static int gd25q_erase_job_start(struct spidev_data *spidev,
+		struct gd25qxx_erase_job *job)
+{
+	struct eventfd_ctx *efd = NULL;
+
+	if (spidev->erase_status == -EINPROGRESS)
+		return -EBUSY;
+	if (!job->len || !IS_ALIGNED(job->addr, gd25q_erase_granularity(spidev)) ||
+	    !IS_ALIGNED(job->len, gd25q_erase_granularity(spidev)))
+		return -EINVAL;
+	if (job->addr > spidev->flash_size || job->len > spidev->flash_size - job->addr)
+		return -EINVAL;
+	if (job->eventfd >= 0) {
+		efd = eventfd_ctx_fdget(job->eventfd);
+		if (IS_ERR(efd))
+			return PTR_ERR(efd);
 	}
+
+	job->id = ++spidev->erase_id;
+	if (!job->id)
+		job->id = ++spidev->erase_id;
+	spidev->erase_eventfd = efd;
+	spidev->erase_addr = job->addr;
+	spidev->erase_len = job->len;
+	spidev->erase_done = 0;
+	spidev->erase_status = -EINPROGRESS;
+	spidev->erase_start = ktime_get();
+	queue_work(gd25q_wq, &spidev->erase_work);
+	return 0;
+}
+
+//拿着buf_lock调用，只记得最近一个任务
+static int gd25q_erase_job_status(struct spidev_data *spidev,
+		struct gd25qxx_erase_status *st)
+{
+	ktime_t end;
+
+	if (!spidev->erase_id || (st->id && st->id != spidev->erase_id))
+		return -ENOENT;
+	end = spidev->erase_status == -EINPROGRESS ? ktime_get() : spidev->erase_end;
+	st->id = spidev->erase_id;
+	st->status = spidev->erase_status;
+	st->addr = spidev->erase_addr;
+	st->len = spidev->erase_len;
+	st->done = spidev->erase_done;
+	st->elapsed_ms = ktime_to_ms(ktime_sub(end, spidev->erase_start));
+	return 0;
+}
+
+/*
+ * 每个打开的文件有自己的位置(f_pos)，几个进程同时打开互不影响。
+ * 擦除的ioctl也用这个位置。
+ */
+static loff_t
+spi_gd25q_llseek(struct file *filp, loff_t offset, int orig)
+{
+	struct spidev_data	*spidev = filp->private_data;
+	loff_t ret;
+
+	ret = fixed_size_llseek(filp, offset, orig, spidev->flash_size);
 	dev_dbg(&spidev->spi->dev, "set curr addr:%02X\n", (unsigned int)ret);
 	return ret;
-
 }
 
 static ssize_t
@@ -368,6 +1443,195 @@ spidev_sync(struct spidev_data *spidev, struct spi_message *message)
 	return status;
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,7,0)
+#define gd25q_max_message_size(spi)	spi_max_message_size(spi)
+#else
+#define gd25q_max_message_size(spi)	SIZE_MAX
+#endif
+
+/*
+ * 发一次读命令，后面连续收len个字节，片选中间不拉高，flash地址自动递增。
+ * 控制器一次传输有长度限制(spi_max_transfer_size)，数据分成几个transfer
+ * 挂在同一个spi_message里。
+ */
+static ssize_t
+spi_gd25q_read_msg(struct spidev_data *spidev, unsigned int addr,
+		void *buf, size_t len, size_t max_xfer)
+{
+	int status;
+	const struct gd25q_read_op *op = spidev->read_op;
+	unsigned char cmd[1 + 4 + GD25Q_MAX_DUMMY] = {0};   //命令 + 3/4字节地址 + dummy
+	struct spi_transfer	t[4] = {
+		{
+			.tx_buf = cmd,
+			.len = 1,
+			.speed_hz = spidev->speed_hz,
+		},
+		{
+			.tx_buf = &cmd[1],
+			.len = spidev->addr_width + op->dummy,
+			.tx_nbits = op->addr_nbits,
+			.speed_hz = spidev->speed_hz,
+		},
+	};
+	struct spi_transfer	*data = &t[2];
+	unsigned int		i, nx = DIV_ROUND_UP(len, max_xfer);
+	struct spi_message	m;
+
+	if (nx > ARRAY_SIZE(t) - 2) {
+		data = kcalloc(nx, sizeof(*data), GFP_KERNEL);
+		if (!data)
+			return -ENOMEM;
+	}
+
+	cmd[0] = op->opcode;
+	gd25q_put_addr(spidev, &cmd[1], addr);
+
+	spi_message_init(&m);
+	spi_message_add_tail(&t[0], &m);
+	spi_message_add_tail(&t[1], &m);
+	for (i = 0; i < nx; i++) {
+		data[i].rx_buf = buf + i * max_xfer;
+		data[i].len = min_t(size_t, len - i * max_xfer, max_xfer);
+		data[i].rx_nbits = op->data_nbits;
+		data[i].speed_hz = spidev->speed_hz;
+		spi_message_add_tail(&data[i], &m);
+	}
+	status = spidev_sync(spidev, &m);
+
+	if (data != &t[2])
+		kfree(data);
+	if (status < 0)
+		return status;
+	return len;
+}
+
+/*
+ * 按当前读模式从addr读len个字节到buf。
+ * 命令单线发，地址和dummy按读命令的地址线宽发，数据按数据线宽收。
+ * 只发一次命令，控制器一个message放不下的时候才分成几次命令。
+ */
+static ssize_t
+spi_gd25q_read_data(struct spidev_data *spidev, unsigned int addr,
+		void *buf, size_t len)
+{
+	struct spi_device *spi = spidev->spi;
+	size_t max_xfer = spi_max_transfer_size(spi);
+	size_t max_msg = gd25q_max_message_size(spi);
+	size_t hdr = 1 + spidev->addr_width + spidev->read_op->dummy;
+	size_t done, n;
+	ssize_t status = 0;
+	ktime_t start;
+	u64 ns;
+	int suspended;
+
+	//几个读进程同时读的时候，芯片的状态和命令序列要串行
+	mutex_lock(&spidev->io_lock);
+	suspended = gd25q_read_begin(spidev, addr, len);
+	if (suspended < 0) {
+		mutex_unlock(&spidev->io_lock);
+		return suspended;
+	}
+
+	if (max_msg <= hdr)
+		max_msg = hdr + max_xfer;
+	for (done = 0; done < len; done += n) {
+		n = min_t(size_t, len - done, max_msg - hdr);
+		start = ktime_get();
+		status = spi_gd25q_read_msg(spidev, addr + done, buf + done,
+				n, max_xfer);
+		ns = gd25q_ns_since(start);
+		trace_gd25q_read(addr + done, n, ns, status < 0 ? status : 0);
+		gd25q_lat_add(spidev->stats.lat_read, ns);
+		if (status < 0)
+			break;
+	}
+
+	if (gd25q_read_end(spidev, suspended) < 0 && status >= 0)
+		status = -EIO;
+	mutex_unlock(&spidev->io_lock);
+	return status < 0 ? status : len;
+}
+
+/*
+ * 缓存里没有的扇区：整个读到新分配的内存里，拷贝要的部分，再放进缓存。
+ * 读的时候不拿cache_lock，别的读进程可以同时用缓存；
+ * 同一个扇区已经被别人放进去了，就不再放这一份。
+ */
+static ssize_t gd25q_cache_fill(struct spidev_data *spidev, unsigned int sector,
+		u8 *buf, unsigned int offset, size_t n)
+{
+	ssize_t status;
+	u8 *data;
+
+	data = kmalloc(GD25QXX_SECTOR, GFP_KERNEL);
+	if (!data)   //没有内存了，直接读
+		return spi_gd25q_read_data(spidev, sector + offset, buf, n);
+
+	status = spi_gd25q_read_data(spidev, sector, data, GD25QXX_SECTOR);
+	if (status < 0) {
+		kfree(data);
+		return status;
+	}
+	memcpy(buf, data + offset, n);
+	gd25q_blank_note(spidev, sector, data);
+
+	mutex_lock(&spidev->cache_lock);
+	if (gd25q_cache_lookup(spidev, sector))
+		kfree(data);
+	else
+		gd25q_cache_insert(spidev, sector, data);
+	mutex_unlock(&spidev->cache_lock);
+	return n;
+}
+
+/*
+ * 带缓存的读。范围内的扇区都在缓存里就直接拷贝；
+ * 小于一个扇区的读(或者fill为true)把缺的扇区整个读进缓存再拷贝；
+ * 大的读直接走总线，不占用缓存。
+ */
+static ssize_t
+gd25q_cache_read(struct spidev_data *spidev, unsigned int addr,
+		u8 *buf, size_t len, bool fill)
+{
+	struct gd25q_cache_entry *e;
+	unsigned int sector, end = addr + len;
+	ssize_t status;
+	size_t n;
+
+	if (!cache_sectors)
+		return spi_gd25q_read_data(spidev, addr, buf, len);
+
+	sector = addr & ~(GD25QXX_SECTOR-1);
+	if (len >= GD25QXX_SECTOR && !fill) {
+		mutex_lock(&spidev->cache_lock);
+		for ( ; sector < end; sector += GD25QXX_SECTOR)
+			if (!gd25q_cache_lookup(spidev, sector))
+				break;
+		mutex_unlock(&spidev->cache_lock);
+		if (sector < end)
+			return spi_gd25q_read_data(spidev, addr, buf, len);
+		sector = addr & ~(GD25QXX_SECTOR-1);
+	}
+
+	for ( ; addr < end; sector += GD25QXX_SECTOR) {
+		n = min_t(size_t, end - addr, sector + GD25QXX_SECTOR - addr);
+		mutex_lock(&spidev->cache_lock);
+		e = gd25q_cache_lookup(spidev, sector);
+		if (e)
+			memcpy(buf, e->data + (addr - sector), n);
+		mutex_unlock(&spidev->cache_lock);
+		if (!e) {
+			status = gd25q_cache_fill(spidev, sector, buf, addr - sector, n);
+			if (status < 0)
+				return status;
+		}
+		buf += n;
+		addr += n;
+	}
+	return len;
+}
+
 
 #if 0
 static int GD25qxx_write_page(GD25qxx_typdef *GD25q64,unsigned int address,unsigned char* buf,int count)
@@ -419,247 +1683,224 @@ static int GD25qxx_write_page(GD25qxx_typdef *GD25q64,unsigned int address,unsig
 
 
 
-//受到硬件的限制，每次最多只能写入256字节，就要切换一页
-static inline ssize_t
-spidev_sync_write(struct spidev_data *spidev, size_t len)
+/*
+ * 页编程，受到硬件的限制，每次最多只能写入256字节，不能跨页。
+ * 写使能和页编程放在一个message里，中间用cs_change拉高一次片选
+ * (WREN在片选拉高时才生效)，每页只要一次spi_sync。
+ */
+static ssize_t
+spi_gd25q_page_program(struct spidev_data *spidev, unsigned int addr,
+		const void *buf, size_t len)
 {
 	int status;
-	char cmd[1] = {PAGE_PROGRAM};
-	unsigned char addr[3];
-	struct spi_transfer c[] = {
+	unsigned char wren[1] = {WRITE_ENABLE};
+	unsigned char cmd[5] = {spidev->pp_opcode};
+	struct spi_transfer t[] = {
 		{
-			.tx_buf = cmd,
-			.len = ARRAY_SIZE(cmd),
+			.tx_buf = wren,
+			.len = ARRAY_SIZE(wren),
+			.cs_change = 1,
+			.speed_hz = spidev->speed_hz,
 		},
 		{
-			.tx_buf = addr,
-			.len = ARRAY_SIZE(addr),
+			.tx_buf = cmd,
+			.len = 1 + spidev->addr_width,
+			.speed_hz = spidev->speed_hz,
 		},
-	};
-	struct spi_transfer t = {
-			.tx_buf		= spidev->tx_buffer,
+		{
+			.tx_buf		= buf,
 			.len		= len,
 			.speed_hz	= spidev->speed_hz,
+		},
 	};
 	struct spi_message	m;
+	ktime_t			start;
 
-	// int i;
-	// for(i=0;i<len;i++)
-	// {
-	// 	printk("%02x ",spidev->tx_buffer[i]);
-	// 	if(i%16 == 15)
-	// 		printk("\n");
-	// }
-	// printk("\n");
+	gd25q_put_addr(spidev, &cmd[1], addr);
 
-
-	addr[0] = (unsigned char)((spidev->cur_addr & 0xff0000) >> 16);
-	addr[1] = (unsigned char)((spidev->cur_addr & 0xff00) >> 8);
-	addr[2] = (unsigned char)(spidev->cur_addr & 0xff);
-
-	spi_gd25q_write_enable(spidev->spi);
+	status = spi_gd25q_wait_ready(spidev);
+	if (status)
+		return status;
 
 	spi_message_init(&m);
-	spi_message_add_tail(&c[0], &m);
-	spi_message_add_tail(&c[1], &m);
-	spi_message_add_tail(&t, &m);
-	spi_gd25q_wait_ready(spidev->spi);
+	spi_message_add_tail(&t[0], &m);
+	spi_message_add_tail(&t[1], &m);
+	spi_message_add_tail(&t[2], &m);
+	//发命令之前就清掉，失败了也可能已经写进去一部分
+	if (spidev->blank && memchr_inv(buf, 0xff, len))
+		clear_bit(addr / GD25QXX_SECTOR, spidev->blank);
+	start = ktime_get();
 	status = spidev_sync(spidev, &m);
-	
-
-	status -= 4;
-	printk("GD25qxx：spidev_sync_write status = %d  len = %lu\n",status,len);
-	if(status > 0)
-		spidev->cur_addr += status;   //更新当前地址
+	trace_gd25q_page_program(addr, len, gd25q_ns_since(start),
+			status < 0 ? status : 0);
+	if (status < 0)
+		return status;
+	gd25q_set_busy(spidev, GD25Q_BUSY_PP, addr, len);
+	atomic64_inc(&spidev->stats.page_programs);
+	atomic64_add(len, &spidev->stats.bytes_programmed);
+	gd25q_flash_programmed(spidev, addr, buf, len);
 
-	return status;
+	return len;
 }
 
+//从addr开始写len个字节，按页分开，不擦除
+static int spi_gd25q_program(struct spidev_data *spidev, unsigned int addr,
+		const u8 *buf, size_t len)
+{
+	size_t n, done;
+	ssize_t status;
+
+	for (done = 0; done < len; done += n) {
+		n = min_t(size_t, len - done,
+			GD25QXX_PAGE_LENGTH - (addr + done) % GD25QXX_PAGE_LENGTH);
+		status = spi_gd25q_page_program(spidev, addr + done, buf + done, n);
+		if (status < 0)
+			return status;
+	}
+	return 0;
+}
 
-
-//读取一个扇区
-static int GD25qxx_read_sector(struct spidev_data *spidev)
+//读取addr所在的一个扇区到rx_buffer
+static int GD25qxx_read_sector(struct spidev_data *spidev, unsigned int addr)
 {
-	int status;
-	char cmd[] = {READ_DATA};
-	unsigned char addr[3];
-	struct spi_transfer	t[] = {
-		{
-			.tx_buf = cmd,
-			.len = ARRAY_SIZE(cmd),
-			.speed_hz = spidev->speed_hz,
-		},
-		{
-			.tx_buf = addr,
-			.len = ARRAY_SIZE(addr),
-		},
-		{
-			.rx_buf		= spidev->rx_buffer,
-			.len		= GD25QXX_SECTOR,//len, 要全部读出来
-			.speed_hz	= spidev->speed_hz,
-		}
-	};
-	struct spi_message	m;
-//	unsigned int sector_first_address = spidev->cur_addr &(~(GD25QXX_SECTOR-1));
-//	低12位为0
-	addr[0] = (unsigned char)((spidev->cur_addr & 0xff0000) >> 16);
-	addr[1] = (unsigned char)((spidev->cur_addr & 0xf000) >> 8);
-	addr[2] = (unsigned char)(0);
+	unsigned int sector_first_address = addr &(~(GD25QXX_SECTOR-1));
 
-	spi_message_init(&m);
-	spi_message_add_tail(&t[0], &m);
-	spi_message_add_tail(&t[1], &m);
-	spi_message_add_tail(&t[2], &m);
-	spi_gd25q_wait_ready(spidev->spi);
-	status = spidev_sync(spidev, &m);
-	
-	return status;	
+	//低12位为0，要全部读出来，放进缓存，后面写完缓存里就是新的内容
+	return gd25q_cache_read(spidev, sector_first_address,
+				spidev->rx_buffer, GD25QXX_SECTOR, true);
 }
 
 
-//需要擦除返回1，不需要返回0
-static int GD25qxx_need_erase(unsigned char*old,unsigned char*new,int count)
+/*
+ * 比较扇区里[start, end)的旧内容old和要写的new(都是扇区缓冲区，下标是扇区内偏移)。
+ * NOR编程能把任意的1变成0，只有new里有old里是0的位，即(old & new) != new，才需要擦除；
+ * 比如标志字节从0x0F改成0x07不用擦除。
+ * 需要擦除返回1，不需要返回0，这时*pages里第i位表示扇区的第i页内容不同，要编程。
+ * rx_buffer和tx_buffer都是kmalloc的，同一个偏移的对齐一样，中间按unsigned long比较，
+ * 两头不对齐的部分逐字节。
+ */
+static int GD25qxx_need_erase(const u8 *old, const u8 *new,
+		unsigned int start, unsigned int end, u32 *pages)
 {
-   int i;
-   unsigned char p;
-
-   for ( i = 0; i < count; i++)
-   {
-      p = *old++;
-
-      if(p == 0xff) {  //这个字节，原是已经擦除的
-      	 //不需要擦除
-      	continue;	
-      }
-      else if(p != new[i])   //这个字节不是0xff,判断是否与写入的字节相同，不相同则需要擦除！！！！
-      {
-         return 1;   //需要擦除
-      }
-      
-   }
+	unsigned int i = start;
+	unsigned long o, w;
+
+	*pages = 0;
+	while (i < end) {
+		if (IS_ALIGNED(i, sizeof(long)) && end - i >= sizeof(long)) {
+			o = *(const unsigned long *)(old + i);
+			w = *(const unsigned long *)(new + i);
+			if (o != w) {
+				if ((o & w) != w)
+					return 1;
+				*pages |= 1U << (i / GD25QXX_PAGE_LENGTH);
+			}
+			i += sizeof(long);
+		} else {
+			if (old[i] != new[i]) {
+				if ((old[i] & new[i]) != new[i])
+					return 1;
+				*pages |= 1U << (i / GD25QXX_PAGE_LENGTH);
+			}
+			i++;
+		}
+	}
 	return 0;
-
 }
 
 
-//len 1-4096 一个扇区的大小，最多16页，每页256字节
-static int GD25qxx_write_pages(struct spidev_data *spidev, size_t len)
+/*
+ * 在一个扇区内写，len 1-4096，最多16页，每页256字节。
+ * 数据在tx_buffer中扇区内偏移(addr % 4096)的位置。
+ * erased为true表示这个扇区已经擦除过了，直接写，不用读出来判断。
+ * 需要擦除时，扇区里原有的其它数据从rx_buffer补到tx_buffer，整个扇区重新写。
+ * 写入的内容和flash上一样就什么都不做；逐页比较，擦除后全0xff的页、
+ * 和flash上内容相同的页都不用编程。
+ */
+static int GD25qxx_write_pages(struct spidev_data *spidev, unsigned int addr,
+		size_t len, bool erased)
 {
-   int ret = -EINVAL;
-   unsigned int remain_of_page,need_to_write;
+   int ret;
    unsigned int sector_first_address,sector_offset;
-//   unsigned int write_address;
- //  unsigned char *write_buf;/*数据缓冲区*/
-   ssize_t total_write;
-
-   // write_buf = (unsigned char*)kzalloc(GD25QXX_SECTOR,GFP_KERNEL);  //GD25QXX_SECTOR_SIZE == 4096
-   // if(!write_buf)
-   //     return -ENOMEM;
-
-   /*获取指定地址所在扇区的扇区首地址*/    //有可能不是一个扇区开始的地址，这里要考虑擦除的时候是一个扇区的擦除。
-   sector_first_address = spidev->cur_addr & (~(GD25QXX_SECTOR-1));//(~(GD25Qxx_PAGE_SIZE-1)) ;   //算出是哪个扇区
-   //write_address = spidev->cur_addr;
+   unsigned int start,end,need_to_write;
+   bool blank = erased;   //flash上要写的这一段是不是全0xff
+   const u8 *src;
+   int action = erased ? GD25Q_RMW_ERASED : GD25Q_RMW_PROGRAM;
+   unsigned int pages = 0;
+   u32 diff_pages = 0;   //内容不同的页，第i位是扇区里第i页
+   int need_erase;
+   ktime_t t0 = ktime_get();
+
+   /*获取指定地址所在扇区的扇区首地址*/
+   sector_first_address = addr & (~(GD25QXX_SECTOR-1));
    /*获取指定地址在所在扇区内的偏移量*/
-   sector_offset = spidev->cur_addr % GD25QXX_SECTOR;    //扇区内的偏移地址？GD25QXX_SECTOR_SIZE == 4096
+   sector_offset = addr % GD25QXX_SECTOR;
 
-   if(len + spidev->sector_offset > GD25QXX_SECTOR)  //数据太多
+   if(len + sector_offset > GD25QXX_SECTOR)  //数据太多
    		return -EMSGSIZE;
 
-   //ret = GD25qxx_read_bytes(GD25q64,sector_first_address,write_buf,GD25QXX_SECTOR_SIZE);//读出整个扇区
-   ret =  GD25qxx_read_sector(spidev);   //读取一个扇区的值
-   if(ret < 0 )
-   {
-      return ret;
-   }
-   // if(spidev->sector_offset > 0)
-   // 		memcpy(write_buf,spidev->rx_buffer,GD25QXX_SECTOR);   //把读取的内容复制到缓存
-   // 	else
-   // 		memcpy(write_buf,spidev->tx_buffer,GD25QXX_SECTOR);
-
+   start = sector_offset;
+   end = sector_offset + len;
 
-   printk("1.GD25qxx GD25qxx_write_pages：spidev->sector_offset = %lu\n",spidev->sector_offset);
-
-   /*判断是否需要擦除*/
-   if(GD25qxx_need_erase(&spidev->rx_buffer[spidev->sector_offset],spidev->tx_buffer,len))
+   if (!erased)   //已经擦除过的扇区不用读出来判断
    {
-      printk("2.GD25qxx GD25qxx_write_pages：GD25qxx：erase\n");
-      //GD25qxx_erase_sector(GD25q64,sector_first_address);
-      spi_gd25q_sector_erase(spidev, GD25QXX_SECTOR-1);
-    //  msleep(500);
-      //这一个扇区的内容重新写入，但是要先更新新的内容
-    //  memcpy(write_buf+spidev->sector_offset,spidev->tx_buffer,len);   //更新内容
-      memcpy(spidev->tx_buffer,spidev->rx_buffer,spidev->sector_offset);
-      remain_of_page = GD25QXX_PAGE_LENGTH;    //从页的第一个字节开始写
-      
-      len = GD25QXX_SECTOR;   //count的总的字节数应该为整个扇区的字节数。因为写入的字节数的后面可能也有数据
-      //sector_offset = 0;   //扇区内的偏移记为0
-      spidev->cur_addr  = sector_first_address;
-      //spidev->cur_addr  = sector_first_address;  //写的起始地址
-      //memcpy(spidev->tx_buffer,write_buf,remain_of_page);  //准备写入的数据
-    //  buf = write_buf;    //写入的数据改为读出来的buf
+      ret = GD25qxx_read_sector(spidev, addr);   //读取一个扇区的值
+      if(ret < 0)
+         goto out;
+
+      /*判断是否需要擦除，不用擦除时顺便得到要编程的页*/
+      need_erase = GD25qxx_need_erase(spidev->rx_buffer,spidev->tx_buffer,
+            start,end,&diff_pages);
+      if(!need_erase && !diff_pages)
+      {
+         action = GD25Q_RMW_UNCHANGED;   //内容没变，不用擦也不用写
+         ret = len;
+         goto out;
+      }
+
+      if(need_erase)
+      {
+         action = GD25Q_RMW_ERASE;
+         atomic64_inc(&spidev->stats.rmw_erases);
+         //这一个扇区的内容重新写入，写入位置前后原来的数据也要写回去
+         memcpy(spidev->tx_buffer,spidev->rx_buffer,start);
+         memcpy(spidev->tx_buffer+end,spidev->rx_buffer+end,GD25QXX_SECTOR-end);
+         ret = spi_gd25q_erase_cmd(spidev, GD25QXX_SECTOR, sector_first_address);
+         if(ret < 0)
+            goto out;
+         start = 0;
+         end = GD25QXX_SECTOR;
+         blank = true;
+      }
    }
-   else //不需要擦除的情况，就直接写入就行。
+
+   //按页写，第一页可能不是从页的开头开始
+   while(start < end)
    {
-   		remain_of_page = GD25QXX_PAGE_LENGTH - spidev->cur_addr%GD25QXX_PAGE_LENGTH;//获取本页还剩多少个字节空间可写入
-   	//	spidev->cur_addr  = write_address; 
+      need_to_write = min_t(unsigned int, end - start,
+            GD25QXX_PAGE_LENGTH - start % GD25QXX_PAGE_LENGTH);
+      src = spidev->tx_buffer + start;
+      if(blank ? !memchr_inv(src, 0xff, need_to_write)
+               : !(diff_pages & (1U << (start / GD25QXX_PAGE_LENGTH))))
+      {
+         start += need_to_write;   //编程了也不会改变flash的内容，跳过
+         continue;
+      }
+      //直接用扇区缓冲区里的位置，不用把数据挪到缓冲区开头
+      ret = spi_gd25q_page_program(spidev, sector_first_address + start,
+            src, need_to_write);
+      if(ret < 0)
+         goto out;
+      pages++;
+      start += need_to_write;
    }
-    
-   need_to_write = remain_of_page;/*下一次最多可写remain_of_page个字节*/
-   total_write = 0;
-   printk("3.GD25qxx GD25qxx_write_pages：sector_first_address=%d,sector_offset=%d\n",sector_first_address,sector_offset);
-
-   printk("4.GD25qxx：cur_addr=%u,len=%lu\n",spidev->cur_addr,len);
-
-   if(len <= need_to_write) //一页以内
-   {
-   	 printk("5.GD25qxx GD25qxx_write_pages：len <= need_to_write,len=%lu\n",len);
-      /*需要写入的字节数少于剩余空间  直接写入实际字节数*/
-      //ret = GD25qxx_write_page(GD25q64,address,buf,count);
-      ret = spidev_sync_write(spidev, len);
-      return ret;
-   }
-   else
-   {    
-      do
-      {
-         ret = spidev_sync_write(spidev, need_to_write);
-         if(ret != need_to_write )
-         {
-         	printk("7.GD25qxx GD25qxx_write_pages：ret =%d ,need_to_write=%d\n",ret,need_to_write);
-            return ret;
-         }
-         total_write += ret;
-         if(need_to_write == len)
-         {        	
-//         	 printk("8.GD25qxx GD25qxx_write_pages：（need_to_write == len） =%d\n",need_to_write);
-             break;
-         }
-         else
-         {
-         //   total_write += ret;//need_to_write;  //已经写入的字节数 
-            len -=   ret;//need_to_write ;   //数据减小          
-            if(len > GD25QXX_PAGE_LENGTH)
-            {
-               need_to_write = GD25QXX_PAGE_LENGTH;  //最多256字节
-            }
-            else
-            {
-               need_to_write = len;
-            }
-
-            //继续下一次
-            memcpy(spidev->tx_buffer,spidev->tx_buffer+total_write,need_to_write);  //准备写入的数据 
-         } 
-         printk("!!!9.GD25qxx GD25qxx_write_pages：total_write =%lu ,need_to_write=%d\n",total_write,need_to_write); 
-
-      } while (1);  
-   }
-
-//	kfree(write_buf);
-	printk("10.GD25qxx GD25qxx_write_pages：total_write =%lu\n",total_write); 
-	return total_write;
-}
+   ret = len;
 
+out:
+   trace_gd25q_rmw(sector_first_address, len, action, pages,
+         gd25q_ns_since(t0), ret < 0 ? ret : 0);
+   return ret;
+}
 
 
 
@@ -726,474 +1967,2234 @@ static int GD25qxx_write_more_bytes(struct spidev_data *spidev, size_t len)
 
 
 
-static inline ssize_t
-spidev_sync_read(struct spidev_data *spidev, size_t len)
+/*
+ * 大的读不经过rx_buffer：把用户的页锁住，vmap成连续的地址交给spi，
+ * spi核心按页建scatterlist做DMA，省掉每4KB一次的拷贝和一次读命令。
+ * 用户地址和长度要按DMA的cache line对齐，不然跟别的数据共用cache line，
+ * 只能走原来的缓冲区。返回读到的字节数，0表示这次不能直接读。
+ */
+static ssize_t
+gd25q_direct_read(struct spidev_data *spidev, unsigned int addr,
+		struct iov_iter *to)
 {
-	int status;
-	char cmd[] = {READ_DATA};
-	unsigned char addr[3];
-	struct spi_transfer	t[] = {
-		{
-			.tx_buf = cmd,
-			.len = ARRAY_SIZE(cmd),
-			.speed_hz = spidev->speed_hz,
-		},
-		{
-			.tx_buf = addr,
-			.len = ARRAY_SIZE(addr),
-		},
-		{
-			.rx_buf		= spidev->rx_buffer,
-			.len		= len,
-			.speed_hz	= spidev->speed_hz,
-		}
-	};
-	struct spi_message	m;
-
-	addr[0] = (unsigned char)((spidev->cur_addr & 0xff0000) >> 16);
-	addr[1] = (unsigned char)((spidev->cur_addr & 0xff00) >> 8);
-	addr[2] = (unsigned char)(spidev->cur_addr & 0xff);
-
-	spi_message_init(&m);
-	spi_message_add_tail(&t[0], &m);
-	spi_message_add_tail(&t[1], &m);
-	spi_message_add_tail(&t[2], &m);
-	spi_gd25q_wait_ready(spidev->spi);
-	status = spidev_sync(spidev, &m);
-	
-
-
-	status -= 4;  //多发了4个字节
-	printk("GD25qxx：spidev_sync_read status = %d  len = %lu\n",status,len);
-	if(status > 0)
-		spidev->cur_addr += status;   //指针向后移动
+	struct page **pages;
+	size_t start;
+	ssize_t len, status;
+	unsigned int npages, i;
+	void *vaddr;
+
+	if (!direct_min || iov_iter_count(to) < direct_min || !iter_is_iovec(to))
+		return 0;
+	if (iov_iter_alignment(to) & (dma_get_cache_alignment() - 1))
+		return 0;
+
+	//整个请求一起锁住，一次读命令读完(iov_iter已经截到flash末尾)
+	len = iov_iter_get_pages_alloc(to, &pages, iov_iter_count(to), &start);
+	if (len <= 0)
+		return len;
+	npages = DIV_ROUND_UP(start + len, PAGE_SIZE);
+
+	vaddr = vmap(pages, npages, VM_MAP, PAGE_KERNEL);
+	if (!vaddr) {
+		status = 0;   //走缓冲区
+		goto out_put;
+	}
 
+	flush_kernel_vmap_range(vaddr + start, len);
+	down_read(&spidev->buf_lock);
+	status = spi_gd25q_read_data(spidev, addr, vaddr + start, len);
+	up_read(&spidev->buf_lock);
+	invalidate_kernel_vmap_range(vaddr + start, len);
+	vunmap(vaddr);
+
+	if (status > 0)
+		iov_iter_advance(to, status);
+out_put:
+	for (i = 0; i < npages; i++) {
+		if (status > 0)
+			set_page_dirty_lock(pages[i]);
+		put_page(pages[i]);
+	}
+	kvfree(pages);
 	return status;
 }
 
-/* Read-only message with current device setup */
+/*
+ * 从*pos开始读，读到iov_iter里，每次最多读bufsiz个字节，读完更新*pos。
+ * 够大、对齐的读直接读到用户的页里。
+ * 几个进程可以同时读，所以不用共用的rx_buffer，每次调用自己分配一个缓冲区，
+ * 拷贝到用户空间的时候不拿锁。
+ * 读到flash末尾返回0。
+ */
 static ssize_t
-spidev_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+gd25q_do_read(struct spidev_data *spidev, loff_t *pos, struct iov_iter *to)
 {
-	struct spidev_data	*spidev;
 	ssize_t			status = 0;
 	ssize_t al_read_size = 0;
-	ssize_t ready_read_size = 0;
-	/* chipselect only toggles at start or end of operation */
-	// if (count > bufsiz)
-	// 	return -EMSGSIZE;
+	size_t ready_read_size, copied = 0;
+	u8 *buf = NULL;
 
-	spidev = filp->private_data;
-	printk("GD25qxx：spidev_sync_read count = %lu",count);	
-	while(count > 0)
+	if (*pos < 0)
+		return -EINVAL;
+	if (*pos >= spidev->flash_size)
+		return 0;
+	iov_iter_truncate(to, spidev->flash_size - *pos);
+
+	while (iov_iter_count(to) > 0)
 	{
-		if(count > bufsiz)
-			ready_read_size = bufsiz;   //最多只能读这么多数据
-		else
-			ready_read_size = count;
-		printk("GD25qxx：spidev_sync_read count = %lu  ready_read_size = %lu\n",count,ready_read_size);
-		mutex_lock(&spidev->buf_lock);
-		status = spidev_sync_read(spidev, ready_read_size);
-		if (status <= ready_read_size) {
-			unsigned long	missing;			
-			count -= status;  //减少，已经读到的数据数
-
-			missing = copy_to_user(buf+al_read_size, spidev->rx_buffer, status);
-			if (missing == status)
-			{
-				status = -EFAULT;
-				mutex_unlock(&spidev->buf_lock);
+		status = gd25q_direct_read(spidev, *pos, to);
+		if (status < 0)
+			break;
+		if (status > 0) {
+			*pos += status;
+			al_read_size += status;
+			continue;
+		}
+
+		ready_read_size = min_t(size_t, iov_iter_count(to), bufsiz);   //最多只能读这么多数据
+		if (!buf) {
+			buf = kmalloc(bufsiz, GFP_KERNEL);
+			if (!buf) {
+				status = -ENOMEM;
+				break;
+			}
+		}
+		copied = 0;
+		down_read(&spidev->buf_lock);
+		status = gd25q_cache_read(spidev, *pos, buf, ready_read_size, false);
+		up_read(&spidev->buf_lock);
+		if (status < 0)
+			break;
+		copied = copy_to_iter(buf, status, to);
+
+		*pos += copied;
+		al_read_size += copied;   //已经读了多少数据
+		if (copied != (size_t)status) {
+			status = -EFAULT;
+			break;
+		}
+	}
+	kfree(buf);
+	atomic64_add(al_read_size, &spidev->stats.bytes_read);
+	return al_read_size ? al_read_size : status;
+}
+
+/*
+ * 顺序写的预擦除。
+ * 只在用户用GD25QXX_IOC_STREAM_BEGIN声明"这个区域会整个重写"之后才做：
+ * 驱动自己猜顺序写去提前擦除的话，写的人中途停下(或者后面本来就不打算写)，
+ * 后面扇区原来的数据就被擦掉了，这和write()只改写写到的字节的语义不符。
+ * 声明的区域里从头开始顺序写的时候，后台worker在写的位置前面最多erase_ahead字节
+ * 用尽量大的块擦除，写的时候这些扇区不用再读出来比较、也不用再擦除。
+ * 芯片擦除时不能编程，所以省下的是擦除和用户准备数据(读文件、解压、网络)的重叠时间、
+ * 大块擦除比逐个扇区擦除快的时间，和每个扇区的读回比较。
+ * worker每擦一个块就放开buf_lock，写的人最多等一个块的擦除；
+ * 写得比预擦除快时当场擦除(ahead_stalls)。
+ * 区域里不按顺序的写、别的地方写进了预擦除的范围、关闭fd、再次声明或者声明长度0，
+ * 都会停止预擦除。
+ */
+static unsigned int gd25q_stream_limit(struct spidev_data *spidev)
+{
+	u64 limit = round_up((u64)spidev->stream_pos + erase_ahead, GD25QXX_SECTOR);
+
+	return min_t(u64, limit, spidev->stream_end);
+}
+
+static void gd25q_stream_work(struct work_struct *work)
+{
+	struct spidev_data *spidev = container_of(work, struct spidev_data, stream_work);
+	int status;
+
+	for (;;) {
+		down_write(&spidev->buf_lock);
+		if (!spidev->spi || !spidev->stream_end ||
+		    spidev->stream_erased >= gd25q_stream_limit(spidev)) {
+			up_write(&spidev->buf_lock);
+			return;
+		}
+		//上一块还在擦的时候放开锁等，读可以插进来
+		status = spi_gd25q_wait_erase(spidev);
+		if (status < 0 || !spidev->stream_end ||
+		    spidev->stream_erased >= gd25q_stream_limit(spidev)) {
+			up_write(&spidev->buf_lock);
+			return;
+		}
+		if(spidev->wp_gpio != INVALID_GPIO_PIN)
+			gpio_set_value(spidev->wp_gpio, 1);
+		status = spi_gd25q_erase_step(spidev, spidev->stream_erased,
+				gd25q_stream_limit(spidev));
+		if(spidev->wp_gpio != INVALID_GPIO_PIN)
+			gpio_set_value(spidev->wp_gpio, 0);
+		if (status < 0) {
+			gd25q_stream_stop(spidev);
+		} else {
+			spidev->stream_erased += status;
+			atomic64_add(status, &spidev->stats.ahead_erased);
+		}
+		up_write(&spidev->buf_lock);
+		if (status < 0)
+			return;
+	}
+}
+
+//声明[addr, addr+len)会从头顺序整个重写，len为0停止。调用时拿着buf_lock
+static int gd25q_stream_begin(struct spidev_data *spidev, struct file *filp,
+		unsigned int addr, unsigned int len)
+{
+	gd25q_stream_stop(spidev);
+	if (!len)
+		return 0;
+	if (!IS_ALIGNED(addr, GD25QXX_SECTOR) || !IS_ALIGNED(len, GD25QXX_SECTOR))
+		return -EINVAL;
+	if (addr > spidev->flash_size || len > spidev->flash_size - addr)
+		return -EINVAL;
+
+	spidev->stream_owner = filp;
+	spidev->stream_start = addr;
+	spidev->stream_end = addr + len;
+	spidev->stream_pos = addr;
+	spidev->stream_erased = addr;
+	if (erase_ahead)
+		queue_work(gd25q_wq, &spidev->stream_work);
+	return 0;
+}
+
+/*
+ * 写[addr, addr+len)之前调用，拿着buf_lock。
+ * 返回1表示这段已经擦除，直接编程；0表示不在顺序写里，按原来的方式写。
+ */
+static int gd25q_stream_write(struct spidev_data *spidev, unsigned int addr, size_t len)
+{
+	unsigned int end;
+	int status;
+
+	if (!spidev->stream_end || addr >= spidev->stream_end ||
+	    addr + len <= spidev->stream_start)
+		return 0;
+	if (addr != spidev->stream_pos || addr + len > spidev->stream_end) {
+		gd25q_stream_stop(spidev);   //不是顺序写了
+		return 0;
+	}
+
+	if (spidev->stream_erased < addr + len) {
+		atomic64_inc(&spidev->stats.ahead_stalls);
+		end = max_t(unsigned int, gd25q_stream_limit(spidev),
+				round_up(addr + len, GD25QXX_SECTOR));
+		while (spidev->stream_erased < addr + len) {
+			status = spi_gd25q_erase_step(spidev, spidev->stream_erased, end);
+			if (status < 0) {
+				gd25q_stream_stop(spidev);
 				return status;
-			}	
-			else{
-				status = status - missing;
 			}
-			al_read_size += status;   //已经读了多少数据
+			spidev->stream_erased += status;
 		}
-		else  //读取出错
-		{
-			printk("GD25qxx：error status > ready_read_size %lu\n",status);
-			mutex_unlock(&spidev->buf_lock);
-			return -EFAULT;
+	}
+	//先移动stream_pos，下面的编程不会被gd25q_flash_programmed当成别人写的
+	spidev->stream_pos = addr + len;
+	if (erase_ahead && spidev->stream_pos < spidev->stream_end)
+		queue_work(gd25q_wq, &spidev->stream_work);
+	return 1;
+}
+
+/*
+ * 写一整个对齐的32KB/64KB块，整块的数据都已经在data里了，调用时拿着buf_lock写锁。
+ * 先把块里不是已知空白的扇区读出来(走扇区缓存)按位规则和新数据比较，
+ * 一半以上的扇区要擦除才用块擦除整块擦掉再逐个扇区编程，一条命令顶好几个扇区擦除；
+ * 不然逐个扇区写，只有要擦除的扇区做读-擦-写，其它的只编程内容不同的页，一样的不动
+ * (比如重新烧写同一个镜像什么都不做)，不为一两个扇区把整块都擦一遍、多磨损一遍。
+ * 整个过程把这个块当成范围擦除(gd25q_wipe_begin)，别人写不进来，
+ * 等擦除、两个扇区之间放开buf_lock，读可以插进来。
+ * erased为true表示这个块已经擦除过了(顺序写预擦除过)，只编程。
+ */
+static int gd25q_write_block(struct spidev_data *spidev, unsigned int addr,
+		size_t len, const u8 *data, bool erased)
+{
+	unsigned int done, dirty = 0, sectors = len / GD25QXX_SECTOR;
+	bool block_erase = false;
+	u32 pages;
+	int status = 0;
+
+	gd25q_wipe_begin(spidev, addr, len);
+	for (done = 0; !erased && done < len; done += GD25QXX_SECTOR) {
+		if (gd25q_blank(spidev, addr + done, GD25QXX_SECTOR))
+			continue;
+		status = GD25qxx_read_sector(spidev, addr + done);
+		if (status < 0)
+			goto out;
+		//放到tx_buffer里和rx_buffer比，两个缓冲区对齐一样(data不一定对齐)
+		memcpy(spidev->tx_buffer, data + done, GD25QXX_SECTOR);
+		if (GD25qxx_need_erase(spidev->rx_buffer, spidev->tx_buffer,
+				0, GD25QXX_SECTOR, &pages) &&
+		    ++dirty * 2 > sectors) {
+			block_erase = true;
+			break;
 		}
-		mutex_unlock(&spidev->buf_lock);		
 	}
-	return status;
+	if (block_erase) {
+		status = spi_gd25q_erase_cmd(spidev, len, addr);
+		if (status >= 0)
+			status = spi_gd25q_wait_erase(spidev);
+	}
+	for (done = 0; status >= 0 && done < len; done += GD25QXX_SECTOR) {
+		if (done) {
+			up_write(&spidev->buf_lock);
+			down_write(&spidev->buf_lock);
+		}
+		memcpy(spidev->tx_buffer, data + done, GD25QXX_SECTOR);
+		//没有块擦除时GD25qxx_write_pages再读一次(缓存命中)，要擦除的只擦这个扇区
+		status = GD25qxx_write_pages(spidev, addr + done, GD25QXX_SECTOR,
+				erased || block_erase ||
+				gd25q_blank(spidev, addr + done, GD25QXX_SECTOR));
+	}
+out:
+	gd25q_wipe_end(spidev);
+	return status < 0 ? status : 0;
 }
 
-/* Write-only message with current device setup */
+/*
+ * 写[addr, addr+len)，数据在data里(内核的缓冲区)，调用时拿着buf_lock写锁。
+ * len不跨扇区，或者是一整个对齐的32KB/64KB块(见gd25q_write_block)。
+ * erased为true表示调用的人保证这段已经擦除过了，直接编程。
+ */
+static int gd25q_write_sector(struct spidev_data *spidev, unsigned int addr,
+		size_t len, const u8 *data, bool erased)
+{
+	size_t offset = addr % GD25QXX_SECTOR;
+	int stream, status;
+
+	gd25q_wait_wipe(spidev, addr, len);
+	stream = gd25q_stream_write(spidev, addr, len);
+	if (stream < 0)
+		return stream;
+	if (len > GD25QXX_SECTOR)
+		return gd25q_write_block(spidev, addr, len, data, erased || stream);
+
+	memcpy(spidev->tx_buffer+offset, data, len);
+	status = GD25qxx_write_pages(spidev, addr, len,
+			erased || stream || gd25q_blank(spidev, addr, len));
+	return status < 0 ? status : 0;
+}
+
+/*
+ * 从addr开始还要写count字节，这次写多少：一般最多写到扇区的末尾，
+ * 对齐的地方后面还有一整个32KB/64KB块(不超过max)时写一整块，见gd25q_write_block。
+ */
+static size_t gd25q_write_unit(struct spidev_data *spidev, unsigned int addr,
+		size_t count, bool erased, size_t max)
+{
+	size_t offset = addr % GD25QXX_SECTOR;
+	size_t n = min_t(size_t, count, GD25QXX_SECTOR - offset);
+	size_t unit;
+
+	if (!erased && offset == 0 && n == GD25QXX_SECTOR) {
+		unit = spi_gd25q_erase_unit(spidev, addr,
+				addr + (count & ~(GD25QXX_SECTOR-1)));
+		if (unit <= max)
+			n = unit;
+	}
+	return n;
+}
+
+/*
+ * 从*pos开始写，数据来自iov_iter，写完更新*pos。
+ * 一般按扇区分开写，每个扇区写完放开一次buf_lock，读可以插进来。
+ * 大块顺序写：后面还有一整个对齐的32KB/64KB块要写的时候整块一起写(用块擦除)。
+ * 拿着buf_lock不能访问用户内存(见spidev_ioctl)，所以每次要写的数据(整块就是整块的数据)
+ * 先拷到自己的缓冲区再拿锁，用户的地址有问题时擦除还没有开始，flash上原来的数据不会丢。
+ * 缓冲区分配不到64KB就只按扇区写。
+ * erased为true表示调用的人保证这段已经擦除过了，直接编程。
+ */
 static ssize_t
-spidev_write(struct file *filp, const char __user *buf,
-		size_t count, loff_t *f_pos)
+gd25q_do_write(struct spidev_data *spidev, loff_t *pos, struct iov_iter *from,
+		bool erased)
 {
-	struct spidev_data	*spidev;
 	ssize_t			status = 0,write_total = 0;
-	unsigned long		missing;
+	size_t count = iov_iter_count(from);
 	size_t need_write;
-	size_t offset;
-//	unsigned char *write_buf;/*数据缓冲区*/
-	/* chipselect only toggles at start or end of operation */
-	// if (count > bufsiz)
-	// 	return -EMSGSIZE;
+	size_t bufmax = GD25QXX_64KB_BLOCK;
+	unsigned int addr;
+	u8 *buf;
 
-	spidev = filp->private_data;
-	if((count + spidev->cur_addr) >= spidev->flash_size) //起始地址加上偏移大于flash的大小，应该是太多了，报错
+	if (*pos < 0)
+		return -EINVAL;
+	if (*pos + count > spidev->flash_size) //起始地址加上偏移大于flash的大小，应该是太多了，报错
 		return -EMSGSIZE;
+	if (count == 0)
+		return 0;
+
+	buf = kmalloc(bufmax, GFP_KERNEL | __GFP_NOWARN);
+	if (!buf) {
+		bufmax = GD25QXX_SECTOR;
+		buf = kmalloc(bufmax, GFP_KERNEL);
+		if (!buf)
+			return -ENOMEM;
+	}
 
-	// write_buf = (unsigned char*)kzalloc(count,GFP_KERNEL);  //GD25QXX_SECTOR_SIZE == 4096
- //   if(!write_buf)
- //       return -ENOMEM;
-
+	addr = *pos;
 
-	printk( "1.spidev_write:count = %lu\n", count);
-	
 	if(spidev->wp_gpio != INVALID_GPIO_PIN)
 		gpio_set_value(spidev->wp_gpio, 1);
-	
-	//第一次需要考虑是否在一个扇区内。
-	offset = spidev->cur_addr % GD25QXX_SECTOR;   //起始地址不是起始值，记录这个偏移
-	printk( "2.spidev_write:first offset = %lu,pidev->cur_addr = %u\n", offset,spidev->cur_addr);
-	need_write = count;
-	if(count > GD25QXX_SECTOR || offset)  //数据大于4096，或者起始地址不是扇区的起始地址
-	{
-		if (count > GD25QXX_SECTOR) { //字节数超过了4096
-			need_write = GD25QXX_SECTOR - offset;  //最多是4096，考虑还有偏移			
-		} 			
-		else if(count + offset > GD25QXX_SECTOR){//起始地址加上字节数 也大于缓存大小
-			need_write = GD25QXX_SECTOR - offset;  //只能先写入这个扇区剩下的字节数了
-		} 
-		else {
-			need_write = count;
-		}			
-	}
-//	printk("3.spidev_write:first count = %lu need_write = %lu\n", count,need_write);
 
 	while(count > 0)
-	{		
-		printk("4.spidev_write:while count = %lu need_write = %lu\n", count,need_write);
-		printk("!!!4.1.spidev_write:pidev->cur_addr = %u,write_total = %lu,offset = %lu\n", spidev->cur_addr,write_total,offset);
-		spidev->sector_offset = offset;//GD25QXX_SECTOR - need_write;
-		mutex_lock(&spidev->buf_lock);
-		missing = copy_from_user(spidev->tx_buffer+offset, buf, need_write);
-		if (missing == 0){
-		//	status = spidev_sync_write(spidev, need_write);
-				// int i;
-				// for(i=0;i<need_write;i++)
-				// {
-				// 	printk("%02x ",spidev->tx_buffer[i]);
-				// 	if(i%16 == 15)
-				// 		printk("\n");
-				// }
-				// printk("\n-----------------------------------------\n");
-			status = GD25qxx_write_pages(spidev, need_write);
-			write_total += status;
-		}
-		else
-		{
-			printk("5.spidev_write: ERROR: copy_from_user\n");
+	{
+		need_write = gd25q_write_unit(spidev, addr, count, erased, bufmax);
+		if (copy_from_iter(buf, need_write, from) != need_write) {
 			status = -EFAULT;
-			mutex_unlock(&spidev->buf_lock);
-			if(spidev->wp_gpio != INVALID_GPIO_PIN)
-				gpio_set_value(spidev->wp_gpio, 0);
-			return status;
-		}	
-		mutex_unlock(&spidev->buf_lock);
-
-		count -= need_write;  //减掉已经读的数据个数
-		buf += need_write;   //向后移动
-		offset = 0;  //第二次开始，不需要偏移了
-
-		if (count > bufsiz)  //字节数超过了4096
-			need_write = bufsiz;
-		else
-			need_write = count;
+			break;
+		}
+		down_write(&spidev->buf_lock);
+		status = gd25q_write_sector(spidev, addr, need_write, buf, erased);
+		up_write(&spidev->buf_lock);
+		if (status < 0)
+			break;
 
-		printk("++++++6.spidev_write: count = %lu need_write = %lu\n", count,need_write);
+		count -= need_write;  //减掉已经写的数据个数
+		addr += need_write;
+		write_total += need_write;
 	}
 
 	if(spidev->wp_gpio != INVALID_GPIO_PIN)
 		gpio_set_value(spidev->wp_gpio, 0);
 
-	printk("+++++7.spidev_write: write_total = %lu \n", write_total);
-	return status;
+	kfree(buf);
+	*pos = addr;
+	atomic64_add(write_total, &spidev->stats.bytes_written);
+	return write_total ? write_total : status;
 }
 
-static long
-spidev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+/*
+ * GD25QXX_IOC_BATCH的一个操作，调用时拿着buf_lock写锁，数据都在内核的缓冲区buf里。
+ * 读用rx_buffer中转(拿着写锁，别人不会用)，写和write()一样按扇区/整块改写。
+ * 全部做完返回op->len，出错返回错误码(统计里还是算上已经读写的字节)。
+ */
+static ssize_t gd25q_batch_op(struct spidev_data *spidev, struct gd25qxx_op *op, u8 *buf)
 {
-	int			err = 0;
-	int			retval = 0;
-	struct spidev_data	*spidev;
-	struct spi_device	*spi;
-	u32			tmp;
-
-	/* Check type and command number */
-	if (_IOC_TYPE(cmd) != GD25QXX_MAGIC)
-		return -ENOTTY;
+	unsigned int addr = op->addr;
+	unsigned int end = op->addr + op->len;
+	bool erased = op->flags & GD25QXX_OP_F_ERASED;
+	size_t n;
+	ssize_t status = 0;
+
+	switch (op->op) {
+	case GD25QXX_OP_READ:
+		for (; addr < end; addr += n, buf += n) {
+			n = min_t(size_t, end - addr, bufsiz);
+			status = gd25q_cache_read(spidev, addr, spidev->rx_buffer, n, false);
+			if (status < 0)
+				break;
+			memcpy(buf, spidev->rx_buffer, n);
+		}
+		atomic64_add(addr - op->addr, &spidev->stats.bytes_read);
+		break;
+	case GD25QXX_OP_WRITE:
+		for (; addr < end; addr += n, buf += n) {
+			n = gd25q_write_unit(spidev, addr, end - addr, erased, end - addr);
+			status = gd25q_write_sector(spidev, addr, n, buf, erased);
+			if (status < 0)
+				break;
+		}
+		atomic64_add(addr - op->addr, &spidev->stats.bytes_written);
+		break;
+	case GD25QXX_OP_ERASE:
+		return spi_gd25q_erase_range(spidev, op->addr, op->len, true);
+	default:
+		return -EINVAL;
+	}
+	return status < 0 ? status : op->len;
+}
 
-	/* Check access direction once here; don't repeat below.
-	 * IOC_DIR is from the user perspective, while access_ok is
-	 * from the kernel perspective; so they look reversed.
-	 */
-	if (_IOC_DIR(cmd) & _IOC_READ)
-		err = !access_ok(VERIFY_WRITE,
-				(void __user *)arg, _IOC_SIZE(cmd));
-	if (err == 0 && _IOC_DIR(cmd) & _IOC_WRITE)
-		err = !access_ok(VERIFY_READ,
-				(void __user *)arg, _IOC_SIZE(cmd));
-	if (err)
+/*
+ * GD25QXX_IOC_BATCH：一次系统调用按顺序做一串读/写/擦除，每个操作自带地址。
+ * 拿着buf_lock不能访问用户内存(见spidev_ioctl)，所以先检查所有操作、把要写的数据
+ * 都拷到内核的缓冲区，再拿一次buf_lock把整串做完(只有等擦除完成的时候放开，读可以插进来)，
+ * 放开锁以后再把读到的数据拷回用户空间。遇到第一个失败的操作就停下，后面的不做。
+ * 读写的总长度不能超过flash的容量。调用时不拿锁。
+ */
+static int gd25q_batch(struct spidev_data *spidev, void __user *arg)
+{
+	struct gd25qxx_batch batch;
+	struct gd25qxx_op *op, *ops;
+	void __user *uops;
+	size_t *offs, total = 0;
+	u8 *data = NULL;
+	ssize_t status = 0;
+	u32 i, done;
+
+	if (copy_from_user(&batch, arg, sizeof(batch)))
 		return -EFAULT;
+	if (batch.count > GD25QXX_BATCH_MAX)
+		return -E2BIG;
+	uops = (void __user *)(uintptr_t)batch.ops;
+	ops = memdup_user(uops, batch.count * sizeof(*ops));
+	if (IS_ERR(ops))
+		return PTR_ERR(ops);
+	offs = kmalloc_array(batch.count + 1, sizeof(*offs), GFP_KERNEL);
+	if (!offs) {
+		status = -ENOMEM;
+		goto out;
+	}
 
-	/* guard against device removal before, or while,
-	 * we issue this ioctl.
-	 */
-	spidev = filp->private_data;
-	spin_lock_irq(&spidev->spi_lock);
-	spi = spi_dev_get(spidev->spi);
-	spin_unlock_irq(&spidev->spi_lock);
+	//每个读写操作在data里的位置
+	for (i = 0; i < batch.count; i++) {
+		op = &ops[i];
+		offs[i] = total;
+		if (op->op != GD25QXX_OP_READ && op->op != GD25QXX_OP_WRITE)
+			continue;
+		if (op->addr > spidev->flash_size ||
+		    op->len > spidev->flash_size - op->addr) {
+			status = -EINVAL;
+			goto out;
+		}
+		total += op->len;
+		if (total > spidev->flash_size) {
+			status = -E2BIG;
+			goto out;
+		}
+	}
+	if (total) {
+		data = vmalloc(total);
+		if (!data) {
+			status = -ENOMEM;
+			goto out;
+		}
+	}
+	for (i = 0; i < batch.count; i++) {
+		op = &ops[i];
+		if (op->op == GD25QXX_OP_WRITE &&
+		    copy_from_user(data + offs[i], (void __user *)(uintptr_t)op->buf, op->len)) {
+			status = -EFAULT;
+			goto out;
+		}
+	}
 
-	if (spi == NULL)
-		return -ESHUTDOWN;
+	if(spidev->wp_gpio != INVALID_GPIO_PIN)
+		gpio_set_value(spidev->wp_gpio, 1);
 
-	/* use the buffer lock here for triple duty:
-	 *  - prevent I/O (from us) so calling spi_setup() is safe;
-	 *  - prevent concurrent SPI_IOC_WR_* from morphing
-	 *    data fields while SPI_IOC_RD_* reads them;
-	 *  - SPI_IOC_MESSAGE needs the buffer locked "normally".
-	 */
-	mutex_lock(&spidev->buf_lock);
+	batch.failed = -1;
+	down_write(&spidev->buf_lock);
+	for (done = 0; done < batch.count; done++) {
+		op = &ops[done];
+		status = gd25q_batch_op(spidev, op, data + offs[done]);
+		op->status = status;
+		if (status < 0) {
+			batch.failed = done;
+			done++;
+			break;
+		}
+	}
+	up_write(&spidev->buf_lock);
 
-	switch (cmd) {
-	/* read requests */
-	case GD25QXX_IOC_SECTOR_ERASE:
-		retval = spi_gd25q_sector_erase(spidev, arg==0?1:arg);
-		break;
-	case GD25QXX_IOC_32KB_BLOCK_ERASE:
-		retval = spi_gd25q_32kb_block_erase(spidev);
-		break;
-	case GD25QXX_IOC_64KB_BLOCK_ERASE:
-		retval = spi_gd25q_64kb_block_erase(spidev);
-		break;
-	case GD25QXX_IOC_CHIP_ERASE:
-		retval = spi_gd25q_chip_erase(spi);
-		break;
+	if(spidev->wp_gpio != INVALID_GPIO_PIN)
+		gpio_set_value(spidev->wp_gpio, 0);
 
-	case GD25QXX_IOC_GET_CAPACITY:  //获取芯片容量，dts中给出
-	// 	printk("ioctrl spidev->flash_size = %u\n",spidev->flash_size);
-		retval = __put_user(spidev->flash_size,(__u32 __user *)arg);
-		break;	
-	case GD25QXX_IOC_GET_ID:  //获取芯片ID，probe给出
-	//	printk("ioctrl spidev->flash_id = %u\n",spidev->flash_id);
-		retval = __put_user(spidev->flash_id,(__u32 __user *)arg);
-		break;	
-	case SPI_IOC_RD_MODE:
-		retval = __put_user(spi->mode & SPI_MODE_MASK,
-					(__u8 __user *)arg);
-		break;
-	case SPI_IOC_RD_MODE32:
-		retval = __put_user(spi->mode & SPI_MODE_MASK,
-					(__u32 __user *)arg);
-		break;
-	case SPI_IOC_RD_LSB_FIRST:
-		retval = __put_user((spi->mode & SPI_LSB_FIRST) ?  1 : 0,
-					(__u8 __user *)arg);
-		break;
-	case SPI_IOC_RD_BITS_PER_WORD:
-		retval = __put_user(spi->bits_per_word, (__u8 __user *)arg);
+	//读成功的数据拷回去，只写回做过的操作的status
+	for (i = 0; i < done; i++) {
+		op = &ops[i];
+		if (op->op == GD25QXX_OP_READ && op->status >= 0 &&
+		    copy_to_user((void __user *)(uintptr_t)op->buf, data + offs[i], op->len))
+			status = -EFAULT;
+	}
+	if (copy_to_user(uops, ops, done * sizeof(*ops)) ||
+	    copy_to_user(arg, &batch, sizeof(batch)))
+		status = -EFAULT;
+out:
+	vfree(data);
+	kfree(offs);
+	kfree(ops);
+	return status < 0 ? status : 0;
+}
+
+/*
+ * 在驱动里算[addr, addr+len)的校验，校验升级后的镜像不用把数据读到用户空间。
+ * 不经过扇区缓存，直接从flash读(用当前的读命令)，每次尽量读64KB，
+ * 每块读的时候拿buf_lock读锁，所以别人同时在写的话结果没有意义。
+ */
+#define GD25Q_CSUM_CHUNK	GD25QXX_64KB_BLOCK
+
+//整段读flash用的缓冲区，64KB分配不到就用bufsiz，只是读命令多几条
+static u8 *gd25q_chunk_alloc(size_t *chunk)
+{
+	u8 *buf;
+
+	*chunk = GD25Q_CSUM_CHUNK;
+	buf = kmalloc(*chunk, GFP_KERNEL | __GFP_NOWARN);
+	if (!buf) {
+		*chunk = bufsiz;
+		buf = kmalloc(*chunk, GFP_KERNEL);
+	}
+	return buf;
+}
+
+static int gd25q_checksum(struct spidev_data *spidev, struct gd25qxx_checksum *ck)
+{
+	struct crypto_shash *tfm = NULL;
+	struct shash_desc *desc = NULL;
+	unsigned int addr = ck->addr, end = ck->addr + ck->len;
+	size_t chunk, n;
+	u32 crc = ~0;
+	u8 *buf = NULL;
+	ssize_t status = 0;
+
+	if (ck->addr > spidev->flash_size || ck->len > spidev->flash_size - ck->addr)
+		return -EINVAL;
+
+	switch (ck->type) {
+	case GD25QXX_CSUM_CRC32:
+	case GD25QXX_CSUM_CRC32C:
+		ck->digest_len = sizeof(crc);
 		break;
-	case SPI_IOC_RD_MAX_SPEED_HZ:
-		retval = __put_user(spidev->speed_hz, (__u32 __user *)arg);
+	case GD25QXX_CSUM_SHA256:
+		tfm = crypto_alloc_shash("sha256", 0, 0);
+		if (IS_ERR(tfm))
+			return PTR_ERR(tfm) == -ENOENT ? -EOPNOTSUPP : PTR_ERR(tfm);
+		desc = kzalloc(sizeof(*desc) + crypto_shash_descsize(tfm), GFP_KERNEL);
+		if (!desc) {
+			status = -ENOMEM;
+			goto out;
+		}
+		desc->tfm = tfm;
+		status = crypto_shash_init(desc);
+		if (status)
+			goto out;
+		ck->digest_len = crypto_shash_digestsize(tfm);
 		break;
+	default:
+		return -EINVAL;
+	}
+
+	buf = gd25q_chunk_alloc(&chunk);
+	if (!buf) {
+		status = -ENOMEM;
+		goto out;
+	}
+
+	for (; addr < end; addr += n) {
+		n = min_t(size_t, end - addr, chunk);
+		down_read(&spidev->buf_lock);
+		status = spi_gd25q_read_data(spidev, addr, buf, n);
+		up_read(&spidev->buf_lock);
+		if (status < 0)
+			break;
+		atomic64_add(n, &spidev->stats.bytes_read);
+
+		if (ck->type == GD25QXX_CSUM_CRC32)
+			crc = crc32_le(crc, buf, n);
+		else if (ck->type == GD25QXX_CSUM_CRC32C)
+			crc = crc32c(crc, buf, n);
+		else
+			status = crypto_shash_update(desc, buf, n);
+		if (status < 0)
+			break;
+		if (fatal_signal_pending(current)) {
+			status = -EINTR;
+			break;
+		}
+	}
+	if (status < 0)
+		goto out;
+
+	memset(ck->digest, 0, sizeof(ck->digest));
+	if (tfm) {
+		status = crypto_shash_final(desc, ck->digest);
+	} else {
+		crc = ~crc;
+		memcpy(ck->digest, &crc, sizeof(crc));
+	}
+out:
+	kfree(buf);
+	kfree(desc);
+	if (tfm)
+		crypto_free_shash(tfm);
+	return status < 0 ? status : 0;
+}
+
+/*
+ * GD25QXX_IOC_BLANK_CHECK：读[addr, addr+len)，更新空白扇区位图，数出空白的扇区。
+ * 和校验一样直接从flash读，每块拿buf_lock读锁(编程和擦除拿写锁，位图不会被同时改)。
+ */
+static int gd25q_blank_check(struct spidev_data *spidev, struct gd25qxx_blank_check *bc)
+{
+	unsigned int addr = bc->addr, end = bc->addr + bc->len, i;
+	size_t chunk, n;
+	ssize_t status = 0;
+	u8 *buf;
+
+	if (!IS_ALIGNED(bc->addr, GD25QXX_SECTOR) || !IS_ALIGNED(bc->len, GD25QXX_SECTOR))
+		return -EINVAL;
+	if (bc->addr > spidev->flash_size || bc->len > spidev->flash_size - bc->addr)
+		return -EINVAL;
+	if (!spidev->blank)
+		return -ENOMEM;
+
+	buf = gd25q_chunk_alloc(&chunk);
+	if (!buf)
+		return -ENOMEM;
+
+	bc->blank = 0;
+	for (; addr < end; addr += n) {
+		n = min_t(size_t, end - addr, chunk);
+		down_read(&spidev->buf_lock);
+		status = spi_gd25q_read_data(spidev, addr, buf, n);
+		if (status >= 0) {
+			for (i = 0; i < n; i += GD25QXX_SECTOR)
+				bc->blank += gd25q_blank_note(spidev, addr + i, buf + i);
+		}
+		up_read(&spidev->buf_lock);
+		if (status < 0)
+			break;
+		atomic64_add(n, &spidev->stats.bytes_read);
+		if (fatal_signal_pending(current)) {
+			status = -EINTR;
+			break;
+		}
+	}
+	kfree(buf);
+	return status < 0 ? status : 0;
+}
+
+//GD25QXX_IOC_CHECKSUM/VERIFY，只读flash，不拿buf_lock写锁
+static int gd25q_checksum_ioctl(struct spidev_data *spidev, unsigned int cmd,
+		void __user *arg)
+{
+	struct gd25qxx_checksum ck;
+	u8 expect[sizeof(ck.digest)];
+	int status;
+
+	if (copy_from_user(&ck, arg, sizeof(ck)))
+		return -EFAULT;
+	memcpy(expect, ck.digest, sizeof(expect));
+
+	status = gd25q_checksum(spidev, &ck);
+	if (status)
+		return status;
+
+	if (cmd == GD25QXX_IOC_VERIFY)
+		return memcmp(expect, ck.digest, ck.digest_len) ? -EBADMSG : 0;
+	if (copy_to_user(arg, &ck, sizeof(ck)))
+		return -EFAULT;
+	return 0;
+}
+
+/* Read-only message with current device setup */
+static ssize_t
+spidev_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+{
+	struct spidev_data	*spidev = filp->private_data;
+	struct iovec		iov;
+	struct iov_iter		iter;
+	ssize_t			status;
+
+	status = import_single_range(READ, buf, count, &iov, &iter);
+	if (status)
+		return status;
+
+	//位置是每个打开的文件自己的，pread的时候f_pos是pread给的位置
+	return gd25q_do_read(spidev, f_pos, &iter);
+}
+
+/* Write-only message with current device setup */
+static ssize_t
+spidev_write(struct file *filp, const char __user *buf,
+		size_t count, loff_t *f_pos)
+{
+	struct spidev_data	*spidev = filp->private_data;
+	struct iovec		iov;
+	struct iov_iter		iter;
+	ssize_t			status;
+
+	status = import_single_range(WRITE, (char __user *)buf, count, &iov, &iter);
+	if (status)
+		return status;
+
+	return gd25q_do_write(spidev, f_pos, &iter, false);
+}
+
+/*
+ * read_iter/write_iter：位置用iocb->ki_pos，可以用preadv/pwritev、aio。
+ * 同步的iocb直接在当前进程里做；异步的(aio)放到驱动的工作队列里做，
+ * 做完调用ki_complete，提交的时候马上返回-EIOCBQUEUED。
+ */
+struct gd25q_aio {
+	struct work_struct	work;
+	struct kiocb		*iocb;
+	struct iov_iter		iter;
+	const void		*iov;	//dup_iter复制的iovec，做完释放
+	struct mm_struct	*mm;	//提交者的地址空间，工作队列里要访问用户的缓冲区
+	bool			write;
+};
+
+static void gd25q_aio_work(struct work_struct *work)
+{
+	struct gd25q_aio *aio = container_of(work, struct gd25q_aio, work);
+	struct kiocb *iocb = aio->iocb;
+	struct spidev_data *spidev = iocb->ki_filp->private_data;
+	ssize_t status;
+
+	use_mm(aio->mm);
+	if (aio->write)
+		status = gd25q_do_write(spidev, &iocb->ki_pos, &aio->iter, false);
+	else
+		status = gd25q_do_read(spidev, &iocb->ki_pos, &aio->iter);
+	unuse_mm(aio->mm);
+
+	mmput(aio->mm);
+	kfree(aio->iov);
+	kfree(aio);
+	iocb->ki_complete(iocb, status, 0);
+}
+
+#ifdef IOCB_NOWAIT
+/*
+ * IOCB_NOWAIT的读写：buf_lock用trylock拿，拿不到或者芯片正在写/擦除就返回-EAGAIN，
+ * 拿到以后一直拿着做完对flash的操作，检查和读写之间不放开锁。
+ * 拿着buf_lock不能访问用户内存(见spidev_ioctl)，所以读先读到自己的缓冲区，放开锁再拷给用户；
+ * 写先把数据拷进来再拿锁。每次最多读bufsiz、写一个扇区或者一整块，可以只读写一部分。
+ * 返回-EAGAIN时把iov_iter退回去，调用的人重新提交的时候数据还在。
+ */
+static ssize_t
+gd25q_read_nowait(struct spidev_data *spidev, loff_t *pos, struct iov_iter *to)
+{
+	size_t n, copied;
+	ssize_t status;
+	u8 *buf;
+
+	if (*pos < 0)
+		return -EINVAL;
+	if (*pos >= spidev->flash_size)
+		return 0;
+	n = min_t(size_t, iov_iter_count(to), bufsiz);
+	n = min_t(size_t, n, spidev->flash_size - *pos);
+
+	buf = kmalloc(n, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	if (!down_read_trylock(&spidev->buf_lock)) {
+		kfree(buf);
+		return -EAGAIN;
+	}
+	if (spidev->busy_op != GD25Q_IDLE)
+		status = -EAGAIN;
+	else
+		status = gd25q_cache_read(spidev, *pos, buf, n, false);
+	up_read(&spidev->buf_lock);
+
+	if (status > 0) {
+		copied = copy_to_iter(buf, status, to);
+		*pos += copied;
+		atomic64_add(copied, &spidev->stats.bytes_read);
+		status = copied ? copied : -EFAULT;
+	}
+	kfree(buf);
+	return status;
+}
+
+static ssize_t
+gd25q_write_nowait(struct spidev_data *spidev, loff_t *pos, struct iov_iter *from)
+{
+	size_t count = iov_iter_count(from);
+	size_t n, bufmax = GD25QXX_64KB_BLOCK;
+	unsigned int addr;
+	ssize_t status;
+	u8 *buf;
+
+	if (*pos < 0)
+		return -EINVAL;
+	if (*pos + count > spidev->flash_size)
+		return -EMSGSIZE;
+	addr = *pos;
+
+	buf = kmalloc(bufmax, GFP_KERNEL | __GFP_NOWARN);
+	if (!buf) {
+		bufmax = GD25QXX_SECTOR;
+		buf = kmalloc(bufmax, GFP_KERNEL);
+		if (!buf)
+			return -ENOMEM;
+	}
+	n = gd25q_write_unit(spidev, addr, count, false, bufmax);
+	if (copy_from_iter(buf, n, from) != n) {
+		kfree(buf);
+		return -EFAULT;
+	}
+
+	if (!down_write_trylock(&spidev->buf_lock)) {
+		status = -EAGAIN;
+		goto out;
+	}
+	if (spidev->busy_op != GD25Q_IDLE || gd25q_wipe_overlaps(spidev, addr, n)) {
+		up_write(&spidev->buf_lock);
+		status = -EAGAIN;
+		goto out;
+	}
+	if(spidev->wp_gpio != INVALID_GPIO_PIN)
+		gpio_set_value(spidev->wp_gpio, 1);
+	status = gd25q_write_sector(spidev, addr, n, buf, false);
+	if(spidev->wp_gpio != INVALID_GPIO_PIN)
+		gpio_set_value(spidev->wp_gpio, 0);
+	up_write(&spidev->buf_lock);
+	if (status == 0) {
+		*pos += n;
+		atomic64_add(n, &spidev->stats.bytes_written);
+		status = n;
+	}
+out:
+	if (status == -EAGAIN)
+		iov_iter_revert(from, n);
+	kfree(buf);
+	return status;
+}
+#endif
+
+static ssize_t
+gd25q_rw_iter(struct kiocb *iocb, struct iov_iter *iter, bool write)
+{
+	struct spidev_data *spidev = iocb->ki_filp->private_data;
+	struct gd25q_aio *aio;
+
+	if (!iov_iter_count(iter))
+		return 0;
+
+#ifdef IOCB_NOWAIT
+	//io_uring先用NOWAIT在提交的进程里试，返回-EAGAIN再放到它自己的线程里阻塞着做
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (write)
+			return gd25q_write_nowait(spidev, &iocb->ki_pos, iter);
+		return gd25q_read_nowait(spidev, &iocb->ki_pos, iter);
+	}
+#endif
+
+	if (is_sync_kiocb(iocb)) {
+		if (write)
+			return gd25q_do_write(spidev, &iocb->ki_pos, iter, false);
+		return gd25q_do_read(spidev, &iocb->ki_pos, iter);
+	}
+
+	aio = kzalloc(sizeof(*aio), GFP_KERNEL);
+	if (!aio)
+		return -ENOMEM;
+	aio->iov = dup_iter(&aio->iter, iter, GFP_KERNEL);
+	if (!aio->iov) {
+		kfree(aio);
+		return -ENOMEM;
+	}
+	aio->mm = get_task_mm(current);
+	if (!aio->mm) {
+		kfree(aio->iov);
+		kfree(aio);
+		return -EFAULT;
+	}
+	aio->iocb = iocb;
+	aio->write = write;
+	INIT_WORK(&aio->work, gd25q_aio_work);
+	queue_work(gd25q_wq, &aio->work);
+
+	return -EIOCBQUEUED;
+}
+
+static ssize_t spidev_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	return gd25q_rw_iter(iocb, to, false);
+}
+
+static ssize_t spidev_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	return gd25q_rw_iter(iocb, from, true);
+}
+
+static long
+spidev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	int			err = 0;
+	int			retval = 0;
+	struct spidev_data	*spidev;
+	struct spi_device	*spi;
+	u32			tmp;
+	size_t			out = 0;   //拷回用户空间的字节数
+	union {
+		struct gd25qxx_erase_range range;
+		struct gd25qxx_erase_job job;
+		struct gd25qxx_erase_status st;
+		struct gd25qxx_geometry geo;
+		u32 val;
+		u8 val8;
+	} u;
+
+	/* Check type and command number */
+	if (_IOC_TYPE(cmd) != GD25QXX_MAGIC)
+		return -ENOTTY;
+
+	/* Check access direction once here; don't repeat below.
+	 * IOC_DIR is from the user perspective, while access_ok is
+	 * from the kernel perspective; so they look reversed.
+	 */
+	if (_IOC_DIR(cmd) & _IOC_READ)
+		err = !access_ok(VERIFY_WRITE,
+				(void __user *)arg, _IOC_SIZE(cmd));
+	if (err == 0 && _IOC_DIR(cmd) & _IOC_WRITE)
+		err = !access_ok(VERIFY_READ,
+				(void __user *)arg, _IOC_SIZE(cmd));
+	if (err)
+		return -EFAULT;
+
+	/* guard against device removal before, or while,
+	 * we issue this ioctl.
+	 */
+	spidev = filp->private_data;
+	spin_lock_irq(&spidev->spi_lock);
+	spi = spi_dev_get(spidev->spi);
+	spin_unlock_irq(&spidev->spi_lock);
+
+	if (spi == NULL)
+		return -ESHUTDOWN;
+
+	//校验、查空白只是读，和read()一样拿读锁，可以和别的读同时进行
+	if (cmd == GD25QXX_IOC_CHECKSUM || cmd == GD25QXX_IOC_VERIFY) {
+		retval = gd25q_checksum_ioctl(spidev, cmd, (void __user *)arg);
+		spi_dev_put(spi);
+		return retval;
+	}
+	if (cmd == GD25QXX_IOC_BLANK_CHECK) {
+		struct gd25qxx_blank_check bc;
+
+		if (copy_from_user(&bc, (void __user *)arg, sizeof(bc)))
+			retval = -EFAULT;
+		else
+			retval = gd25q_blank_check(spidev, &bc);
+		if (retval == 0 && copy_to_user((void __user *)arg, &bc, sizeof(bc)))
+			retval = -EFAULT;
+		spi_dev_put(spi);
+		return retval;
+	}
+	//批量操作先在锁外面拷贝用户的数据，再自己拿锁
+	if (cmd == GD25QXX_IOC_BATCH) {
+		retval = gd25q_batch(spidev, (void __user *)arg);
+		spi_dev_put(spi);
+		return retval;
+	}
+
+	/*
+	 * 拿着buf_lock不能访问用户内存：用户的地址可能是本设备mmap出来的，
+	 * 缺页时拿着mmap_sem再拿buf_lock(gd25q_vm_fault)，和这里反过来就是ABBA死锁。
+	 * 参数在拿锁之前拷进u，结果放在u里，放开锁以后再拷出去(out个字节)。
+	 */
+	memset(&u, 0, sizeof(u));
+	switch (cmd) {
+	case GD25QXX_IOC_RANGE_ERASE:
+	case GD25QXX_IOC_STREAM_BEGIN:
+	case GD25QXX_IOC_ERASE_ASYNC:
+	case GD25QXX_IOC_ERASE_STATUS:
+	case GD25QXX_IOC_SET_READ_MODE:
+	case SPI_IOC_WR_MODE:
+	case SPI_IOC_WR_MODE32:
+	case SPI_IOC_WR_LSB_FIRST:
+	case SPI_IOC_WR_BITS_PER_WORD:
+	case SPI_IOC_WR_MAX_SPEED_HZ:
+		if (_IOC_SIZE(cmd) > sizeof(u) ||
+		    copy_from_user(&u, (void __user *)arg, _IOC_SIZE(cmd))) {
+			spi_dev_put(spi);
+			return -EFAULT;
+		}
+		break;
+	}
+
+	/* use the buffer lock here for triple duty:
+	 *  - prevent I/O (from us) so calling spi_setup() is safe;
+	 *  - prevent concurrent SPI_IOC_WR_* from morphing
+	 *    data fields while SPI_IOC_RD_* reads them;
+	 *  - SPI_IOC_MESSAGE needs the buffer locked "normally".
+	 */
+	down_write(&spidev->buf_lock);
+
+	switch (cmd) {
+	/* read requests */
+	//擦除的ioctl等擦除真正完成才返回，等的时候放开buf_lock，读可以暂停擦除
+	case GD25QXX_IOC_SECTOR_ERASE:
+		retval = spi_gd25q_sector_erase(spidev, filp->f_pos, arg==0?1:arg);
+		break;
+	case GD25QXX_IOC_32KB_BLOCK_ERASE:
+		retval = spi_gd25q_32kb_block_erase(spidev, filp->f_pos);
+		if (retval >= 0)
+			retval = spi_gd25q_wait_erase(spidev);
+		break;
+	case GD25QXX_IOC_64KB_BLOCK_ERASE:
+		retval = spi_gd25q_64kb_block_erase(spidev, filp->f_pos);
+		if (retval >= 0)
+			retval = spi_gd25q_wait_erase(spidev);
+		break;
+	case GD25QXX_IOC_CHIP_ERASE:
+		retval = spi_gd25q_chip_erase(spidev);
+		if (retval >= 0)
+			retval = spi_gd25q_wait_erase(spidev);
+		break;
+	case GD25QXX_IOC_RANGE_ERASE:
+		retval = spi_gd25q_erase_range(spidev, u.range.addr, u.range.len, true);
+		break;
+	case GD25QXX_IOC_ERASE_ASYNC:
+		retval = gd25q_erase_job_start(spidev, &u.job);
+		out = sizeof(u.job);
+		break;
+	case GD25QXX_IOC_ERASE_STATUS:
+		retval = gd25q_erase_job_status(spidev, &u.st);
+		out = sizeof(u.st);
+		break;
+	case GD25QXX_IOC_STREAM_BEGIN:
+		retval = gd25q_stream_begin(spidev, filp, u.range.addr, u.range.len);
+		break;
+
+	case GD25QXX_IOC_GET_CAPACITY:  //获取芯片容量，probe时从SFDP/ID表/dts得到
+	// 	printk("ioctrl spidev->flash_size = %u\n",spidev->flash_size);
+		u.val = spidev->flash_size;
+		out = sizeof(u.val);
+		break;	
+	case GD25QXX_IOC_GET_ID:  //获取芯片ID，probe给出
+	//	printk("ioctrl spidev->flash_id = %u\n",spidev->flash_id);
+		u.val = spidev->flash_id;
+		out = sizeof(u.val);
+		break;	
+	case GD25QXX_IOC_SET_READ_MODE:
+		retval = spi_gd25q_set_read_mode(spidev, u.val);
+		break;
+	case GD25QXX_IOC_GET_READ_MODE:  //返回实际使用的模式，不会是AUTO
+		u.val = spidev->read_op - spidev->read_ops;
+		out = sizeof(u.val);
+		break;
+	case GD25QXX_IOC_GET_GEOMETRY:
+		u.geo = spidev->geo;
+		u.geo.read_mode = spidev->read_op - spidev->read_ops;
+		out = sizeof(u.geo);
+		break;
+	case SPI_IOC_RD_MODE:
+		u.val8 = spi->mode & SPI_MODE_MASK;
+		out = sizeof(u.val8);
+		break;
+	case SPI_IOC_RD_MODE32:
+		u.val = spi->mode & SPI_MODE_MASK;
+		out = sizeof(u.val);
+		break;
+	case SPI_IOC_RD_LSB_FIRST:
+		u.val8 = (spi->mode & SPI_LSB_FIRST) ?  1 : 0;
+		out = sizeof(u.val8);
+		break;
+	case SPI_IOC_RD_BITS_PER_WORD:
+		u.val8 = spi->bits_per_word;
+		out = sizeof(u.val8);
+		break;
+	case SPI_IOC_RD_MAX_SPEED_HZ:
+		u.val = spidev->speed_hz;
+		out = sizeof(u.val);
+		break;
+
+	/* write requests */
+	case SPI_IOC_WR_MODE:
+	case SPI_IOC_WR_MODE32:
+		tmp = cmd == SPI_IOC_WR_MODE ? u.val8 : u.val;
+		{
+			u32	save = spi->mode;
+
+			if (tmp & ~SPI_MODE_MASK) {
+				retval = -EINVAL;
+				break;
+			}
+
+			tmp |= spi->mode & ~SPI_MODE_MASK;
+			spi->mode = (u16)tmp;
+			retval = spi_setup(spi);
+			if (retval < 0)
+				spi->mode = save;
+			else {
+				dev_dbg(&spi->dev, "spi mode %x\n", tmp);
+				//线宽可能变了，重新选读命令，不支持了就回到自动
+				if (spi_gd25q_set_read_mode(spidev, spidev->read_mode))
+					spi_gd25q_set_read_mode(spidev, GD25QXX_READ_AUTO);
+			}
+		}
+		break;
+	case SPI_IOC_WR_LSB_FIRST:
+		tmp = u.val8;
+		{
+			u32	save = spi->mode;
+
+			if (tmp)
+				spi->mode |= SPI_LSB_FIRST;
+			else
+				spi->mode &= ~SPI_LSB_FIRST;
+			retval = spi_setup(spi);
+			if (retval < 0)
+				spi->mode = save;
+			else
+				dev_dbg(&spi->dev, "%csb first\n",
+						tmp ? 'l' : 'm');
+		}
+		break;
+	case SPI_IOC_WR_BITS_PER_WORD:
+		tmp = u.val8;
+		{
+			u8	save = spi->bits_per_word;
+
+			spi->bits_per_word = tmp;
+			retval = spi_setup(spi);
+			if (retval < 0)
+				spi->bits_per_word = save;
+			else
+				dev_dbg(&spi->dev, "%d bits per word\n", tmp);
+		}
+		break;
+	case SPI_IOC_WR_MAX_SPEED_HZ:
+		tmp = u.val;
+		{
+			u32	save = spi->max_speed_hz;
+
+			spi->max_speed_hz = tmp;
+			retval = spi_setup(spi);
+			if (retval >= 0)
+				spidev->speed_hz = tmp;
+			else
+				dev_dbg(&spi->dev, "%d Hz (max)\n", tmp);
+			spi->max_speed_hz = save;
+		}
+		break;
+	default:
+		retval = -EINVAL;   //不能直接返回，还拿着buf_lock
+		break;
+	}
+
+	up_write(&spidev->buf_lock);
+	spi_dev_put(spi);
+
+	if (retval >= 0 && out && copy_to_user((void __user *)arg, &u, out))
+		retval = -EFAULT;
+	return retval;
+}
+
+/*
+ * 只读mmap：缺页时用读接口把flash的内容读到一个页里，页保存在mmap_pages中，
+ * 多个映射共用；写和擦除时由gd25q_mmap_invalidate()解除映射并释放。
+ * 缺页时拿着mmap_sem再拿buf_lock的读锁，所以别的地方拿着buf_lock时都不能访问用户内存。
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+static int gd25q_vm_fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+#else
+static int gd25q_vm_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+#endif
+	struct spidev_data *spidev = vma->vm_private_data;
+	struct page *page, *newpage;
+	ssize_t status;
+
+	down_read(&spidev->buf_lock);
+	if (vmf->pgoff >= spidev->mmap_npages) {
+		up_read(&spidev->buf_lock);
+		return VM_FAULT_SIGBUS;
+	}
+
+	mutex_lock(&spidev->cache_lock);
+	page = spidev->mmap_pages[vmf->pgoff];
+	if (page)
+		get_page(page);
+	mutex_unlock(&spidev->cache_lock);
+
+	if (!page) {
+		//读flash的时候不拿cache_lock，别的进程可能同时读了同一页，先装进去的算数
+		newpage = alloc_page(GFP_KERNEL);
+		if (!newpage) {
+			up_read(&spidev->buf_lock);
+			return VM_FAULT_OOM;
+		}
+		status = gd25q_cache_read(spidev, vmf->pgoff << PAGE_SHIFT,
+				page_address(newpage), PAGE_SIZE, false);
+		if (status < 0) {
+			__free_page(newpage);
+			up_read(&spidev->buf_lock);
+			return VM_FAULT_SIGBUS;
+		}
+		mutex_lock(&spidev->cache_lock);
+		page = spidev->mmap_pages[vmf->pgoff];
+		if (!page) {
+			page = newpage;
+			newpage = NULL;
+			spidev->mmap_pages[vmf->pgoff] = page;
+		}
+		get_page(page);
+		mutex_unlock(&spidev->cache_lock);
+		if (newpage)
+			__free_page(newpage);
+	}
+	up_read(&spidev->buf_lock);
+
+	vmf->page = page;
+	return 0;
+}
+
+static const struct vm_operations_struct gd25q_vm_ops = {
+	.fault = gd25q_vm_fault,
+};
+
+static int spidev_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct spidev_data *spidev = filp->private_data;
+	struct inode *inode = file_inode(filp);
+	unsigned long npages = DIV_ROUND_UP(spidev->flash_size, PAGE_SIZE);
+	int status = 0;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	if (vma->vm_pgoff >= npages || vma_pages(vma) > npages - vma->vm_pgoff)
+		return -EINVAL;
+
+	down_write(&spidev->buf_lock);
+	if (!spidev->mmap_pages) {
+		struct page **pages = vzalloc(npages * sizeof(struct page *));
+
+		if (!pages) {
+			status = -ENOMEM;
+			goto out;
+		}
+		//和gd25q_mmap_free()一样，指针在cache_lock里面改
+		mutex_lock(&spidev->cache_lock);
+		spidev->mmap_npages = npages;
+		spidev->mmap_inode = igrab(inode);
+		spidev->mmap_pages = pages;
+		mutex_unlock(&spidev->cache_lock);
+	} else if (spidev->mmap_inode != inode) {
+		//只跟踪一个设备节点的映射，不然写的时候解除不了其它节点的映射
+		status = -EBUSY;
+		goto out;
+	}
+out:
+	up_write(&spidev->buf_lock);
+	if (status)
+		return status;
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	vma->vm_private_data = spidev;
+	vma->vm_ops = &gd25q_vm_ops;
+	return 0;
+}
+
+#ifdef CONFIG_COMPAT
+static long
+spidev_compat_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	return spidev_ioctl(filp, cmd, (unsigned long)compat_ptr(arg));
+}
+#else
+#define spidev_compat_ioctl NULL
+#endif /* CONFIG_COMPAT */
+
+//异步擦除没做完时不报POLLOUT，读随时可以
+static unsigned int spidev_poll(struct file *filp, poll_table *wait)
+{
+	struct spidev_data *spidev = filp->private_data;
+	unsigned int mask = POLLIN | POLLRDNORM;
+
+	poll_wait(filp, &spidev->erase_wait, wait);
+	if (READ_ONCE(spidev->erase_status) != -EINPROGRESS)
+		mask |= POLLOUT | POLLWRNORM;
+	return mask;
+}
+
+static int spidev_open(struct inode *inode, struct file *filp)
+{
+	struct spidev_data	*spidev;
+	int			status = -ENXIO;
+
+	mutex_lock(&device_list_lock);
+
+	list_for_each_entry(spidev, &device_list, device_entry) {
+		if (spidev->devt == inode->i_rdev) {
+			status = 0;
+			break;
+		}
+	}
+
+	if (status) {
+		pr_debug("spidev: nothing for minor %d\n", iminor(inode));
+		goto err_find_dev;
+	}
+
+	if (!spidev->tx_buffer) {
+		spidev->tx_buffer = kmalloc(bufsiz, GFP_KERNEL);
+		if (!spidev->tx_buffer) {
+			dev_err(&spidev->spi->dev, "open/ENOMEM\n");
+			status = -ENOMEM;
+			goto err_find_dev;
+		}
+	}
+
+	if (!spidev->rx_buffer) {
+		spidev->rx_buffer = kmalloc(bufsiz, GFP_KERNEL);
+		if (!spidev->rx_buffer) {
+			dev_err(&spidev->spi->dev, "open/ENOMEM\n");
+			status = -ENOMEM;
+			goto err_alloc_rx_buf;
+		}
+	}
+
+	spidev->users++;
+	filp->private_data = spidev;
+#ifdef FMODE_NOWAIT
+	filp->f_mode |= FMODE_NOWAIT;   //支持IOCB_NOWAIT，见gd25q_read_nowait
+#endif
+
+	mutex_unlock(&device_list_lock);
+	return 0;
+
+err_alloc_rx_buf:
+	kfree(spidev->tx_buffer);
+	spidev->tx_buffer = NULL;
+err_find_dev:
+	mutex_unlock(&device_list_lock);
+	return status;
+}
+
+static int spidev_release(struct inode *inode, struct file *filp)
+{
+	struct spidev_data	*spidev;
+
+	mutex_lock(&device_list_lock);
+	spidev = filp->private_data;
+	filp->private_data = NULL;
+
+	down_write(&spidev->buf_lock);
+	if (spidev->stream_owner == filp)
+		gd25q_stream_stop(spidev);
+	up_write(&spidev->buf_lock);
+
+	/* last close? */
+	spidev->users--;
+	if (!spidev->users) {
+		int		dofree;
+
+		kfree(spidev->tx_buffer);
+		spidev->tx_buffer = NULL;
+
+		kfree(spidev->rx_buffer);
+		spidev->rx_buffer = NULL;
+
+		gd25q_mmap_free(spidev);
+
+		spin_lock_irq(&spidev->spi_lock);
+		if (spidev->spi)
+			spidev->speed_hz = spidev->spi->max_speed_hz;
+
+		/* ... after we unbound from the underlying device? */
+		dofree = (spidev->spi == NULL);
+		spin_unlock_irq(&spidev->spi_lock);
+
+		if (dofree) {
+			cancel_work_sync(&spidev->stream_work);
+			kfree(spidev);
+		}
+	}
+	mutex_unlock(&device_list_lock);
+
+	return 0;
+}
+
+static const struct file_operations spidev_fops = {
+	.owner =	THIS_MODULE,
+	.write =	spidev_write,
+	.read =		spidev_read,
+	.write_iter =	spidev_write_iter,
+	.read_iter =	spidev_read_iter,
+	.unlocked_ioctl = spidev_ioctl,
+	.compat_ioctl = spidev_compat_ioctl,
+	.open =		spidev_open,
+	.release =	spidev_release,
+	.llseek =	spi_gd25q_llseek,
+	.mmap =		spidev_mmap,
+	.poll =		spidev_poll,
+};
+
+/*-------------------------------------------------------------------------*/
+
+static struct dentry *gd25q_debugfs_root;
+
+static inline u64 gd25q_stat(atomic64_t *v)
+{
+	return atomic64_read(v);
+}
+
+static int gd25q_stats_show(struct seq_file *m, void *v)
+{
+	struct spidev_data *spidev = m->private;
+	struct gd25q_stats *st = &spidev->stats;
+	u64 written = gd25q_stat(&st->bytes_written);
+	u64 amp = written ? div64_u64(gd25q_stat(&st->bytes_programmed) * 100, written) : 0;
+	atomic_t *hist;
+	int op, i, n;
+
+	seq_printf(m, "bytes_read:          %llu\n", gd25q_stat(&st->bytes_read));
+	seq_printf(m, "bytes_written:       %llu\n", written);
+	seq_printf(m, "bytes_programmed:    %llu\n", gd25q_stat(&st->bytes_programmed));
+	seq_printf(m, "write_amplification: %llu.%02llu\n", amp / 100, amp % 100);
+	seq_printf(m, "page_programs:       %llu\n", gd25q_stat(&st->page_programs));
+	seq_printf(m, "sector_erases:       %llu\n", gd25q_stat(&st->sector_erases));
+	seq_printf(m, "block32_erases:      %llu\n", gd25q_stat(&st->block32_erases));
+	seq_printf(m, "block64_erases:      %llu\n", gd25q_stat(&st->block64_erases));
+	seq_printf(m, "chip_erases:         %llu\n", gd25q_stat(&st->chip_erases));
+	seq_printf(m, "rmw_erases:          %llu\n", gd25q_stat(&st->rmw_erases));
+	seq_printf(m, "status_polls:        %llu\n", gd25q_stat(&st->status_polls));
+	seq_printf(m, "erase_suspends:      %llu\n", gd25q_stat(&st->erase_suspends));
+	seq_printf(m, "ahead_erased:        %llu\n", gd25q_stat(&st->ahead_erased));
+	seq_printf(m, "ahead_stalls:        %llu\n", gd25q_stat(&st->ahead_stalls));
+	seq_printf(m, "blank_skips:         %llu\n", gd25q_stat(&st->blank_skips));
+	if (spidev->blank)
+		seq_printf(m, "blank_sectors:       %d/%u\n",
+			bitmap_weight(spidev->blank, spidev->blank_sectors),
+			spidev->blank_sectors);
+
+	//op为GD25Q_IDLE的时候打印读的直方图
+	for (op = GD25Q_IDLE; op <= GD25Q_BUSY_CE; op++) {
+		if (op == GD25Q_BUSY_UNKNOWN)
+			continue;
+		hist = op == GD25Q_IDLE ? st->lat_read : st->lat_busy[op];
+		seq_printf(m, "\nlatency %s:\n",
+			op == GD25Q_IDLE ? "read" : gd25q_busy_timing[op].name);
+		for (i = 0; i < GD25Q_LAT_BUCKETS; i++) {
+			n = atomic_read(&hist[i]);
+			if (n)
+				seq_printf(m, "  < %10lu us: %d\n", 1UL << i, n);
+		}
+	}
+	return 0;
+}
+
+static int gd25q_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, gd25q_stats_show, inode->i_private);
+}
+
+//写任何内容都把统计清零，和正在进行的操作同时清零的话可能漏掉几个计数
+static ssize_t gd25q_stats_write(struct file *file, const char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct spidev_data *spidev = m->private;
+
+	memset(&spidev->stats, 0, sizeof(spidev->stats));
+	return count;
+}
+
+static const struct file_operations gd25q_stats_fops = {
+	.owner =	THIS_MODULE,
+	.open =		gd25q_stats_open,
+	.read =		seq_read,
+	.write =	gd25q_stats_write,
+	.llseek =	seq_lseek,
+	.release =	single_release,
+};
+
+//debugfs没打开或者创建失败都不影响驱动使用
+static void gd25q_debugfs_init(struct spidev_data *spidev)
+{
+	if (IS_ERR_OR_NULL(gd25q_debugfs_root))
+		return;
+	spidev->debugfs = debugfs_create_dir(dev_name(&spidev->spi->dev),
+			gd25q_debugfs_root);
+	if (IS_ERR_OR_NULL(spidev->debugfs))
+		return;
+	debugfs_create_file("stats", S_IRUSR | S_IWUSR, spidev->debugfs,
+			spidev, &gd25q_stats_fops);
+	if (spidev->wear) {
+		spidev->wear_blob.data = spidev->wear;
+		spidev->wear_blob.size = spidev->wear_sectors * sizeof(u32);
+		debugfs_create_blob("wear", S_IRUSR, spidev->debugfs,
+				&spidev->wear_blob);
+	}
+}
+
+/*-------------------------------------------------------------------------*/
+
+/*
+ * 擦除次数。每个4KB扇区一个u32，debugfs的wear文件就是这个数组(小端)。
+ * dts里配置了wear-offset的话，计数保存在flash的这个位置(4KB对齐)，probe时读回来，
+ * 每wear_save_interval秒有变化就保存一次，卸载时再保存一次。
+ * 一条记录是 16字节头 + 扇区数*4，按页对齐占一个位置；区域大小默认是一条记录向上取整到4KB，
+ * dts里的wear-size可以给大一些。保存时往区域里下一个没写过的位置追加一条(擦除后的flash直接编程)，
+ * 写满了才擦除整个区域从头再来，区域能放N条记录，这几个扇区的擦除就少N倍。
+ * 读回时用最后一条完整的记录。这个区域不要再放别的数据。
+ */
+#define GD25Q_WEAR_MAGIC	0x52574447	//"GDWR"
+
+struct gd25q_wear_hdr {
+	__le32	magic;
+	__le32	sectors;
+	__le32	crc;		//计数数组的crc32
+	__le32	reserved;
+};
+
+//读第slot条记录到hdr，完整的返回true
+static bool gd25q_wear_read(struct spidev_data *spidev, unsigned int slot,
+		struct gd25q_wear_hdr *hdr, size_t n)
+{
+	ssize_t status;
+
+	down_read(&spidev->buf_lock);
+	status = gd25q_cache_read(spidev, spidev->wear_offset + slot * spidev->wear_slot,
+			(u8 *)hdr, sizeof(*hdr) + n, false);
+	up_read(&spidev->buf_lock);
+
+	return status >= 0 && le32_to_cpu(hdr->magic) == GD25Q_WEAR_MAGIC &&
+	       le32_to_cpu(hdr->sectors) == spidev->wear_sectors &&
+	       le32_to_cpu(hdr->crc) == crc32_le(~0, (u8 *)(hdr + 1), n);
+}
+
+static void gd25q_wear_load(struct spidev_data *spidev)
+{
+	struct gd25q_wear_hdr *hdr;
+	size_t n = spidev->wear_sectors * sizeof(u32);
+	unsigned int slots = spidev->wear_size / spidev->wear_slot;
+	__le32 *cnt;
+	unsigned int i;
+	ssize_t status;
+
+	hdr = vmalloc(sizeof(*hdr) + n);
+	if (!hdr)
+		return;
+	cnt = (__le32 *)(hdr + 1);
+
+	//记录是从头顺序写的，头还是全0xff的位置就是下一条记录的位置
+	for (i = 0; i < slots; i++) {
+		down_read(&spidev->buf_lock);
+		status = gd25q_cache_read(spidev,
+				spidev->wear_offset + i * spidev->wear_slot,
+				(u8 *)hdr, sizeof(*hdr), false);
+		up_read(&spidev->buf_lock);
+		if (status < 0 || !memchr_inv(hdr, 0xff, sizeof(*hdr)))
+			break;
+	}
+	spidev->wear_next = i;
+
+	//写到一半断电的记录校验不过，用前一条
+	while (i-- > 0) {
+		if (gd25q_wear_read(spidev, i, hdr, n))
+			break;
+	}
+	if (i >= slots) {
+		dev_info(&spidev->spi->dev, "no saved erase counters at %#x\n",
+			spidev->wear_offset);
+	} else {
+		for (i = 0; i < spidev->wear_sectors; i++)
+			spidev->wear[i] = le32_to_cpu(cnt[i]);
+	}
+	vfree(hdr);
+}
+
+//保存擦除次数，调用时要持有buf_lock
+static int gd25q_wear_save(struct spidev_data *spidev)
+{
+	struct gd25q_wear_hdr *hdr;
+	size_t n = spidev->wear_sectors * sizeof(u32);
+	unsigned int slots = spidev->wear_size / spidev->wear_slot;
+	__le32 *cnt;
+	unsigned int i;
+	int status = 0;
+
+	hdr = vmalloc(sizeof(*hdr) + n);
+	if (!hdr)
+		return -ENOMEM;
+	cnt = (__le32 *)(hdr + 1);
+
+	if(spidev->wp_gpio != INVALID_GPIO_PIN)
+		gpio_set_value(spidev->wp_gpio, 1);
+
+	//写满了先擦除，保存的计数里包括这次擦除
+	if (spidev->wear_next >= slots) {
+		status = spi_gd25q_erase_range(spidev, spidev->wear_offset,
+				spidev->wear_size, false);
+		if (status == 0)
+			spidev->wear_next = 0;
+	}
+	if (status == 0) {
+		for (i = 0; i < spidev->wear_sectors; i++)
+			cnt[i] = cpu_to_le32(spidev->wear[i]);
+		hdr->magic = cpu_to_le32(GD25Q_WEAR_MAGIC);
+		hdr->sectors = cpu_to_le32(spidev->wear_sectors);
+		hdr->crc = cpu_to_le32(crc32_le(~0, (u8 *)cnt, n));
+		hdr->reserved = 0;
+		//写失败这个位置也不干净了，下次用下一个
+		status = spi_gd25q_program(spidev,
+				spidev->wear_offset + spidev->wear_next++ * spidev->wear_slot,
+				(u8 *)hdr, sizeof(*hdr) + n);
+	}
+	if (status == 0)
+		status = spi_gd25q_wait_ready(spidev);
+
+	if(spidev->wp_gpio != INVALID_GPIO_PIN)
+		gpio_set_value(spidev->wp_gpio, 0);
+
+	if (status == 0)
+		spidev->wear_dirty = false;
+	else
+		dev_err(&spidev->spi->dev, "save erase counters failed %d\n", status);
+	vfree(hdr);
+	return status;
+}
+
+static void gd25q_wear_work(struct work_struct *work)
+{
+	struct spidev_data *spidev = container_of(to_delayed_work(work),
+			struct spidev_data, wear_work);
+
+	down_write(&spidev->buf_lock);
+	if (spidev->wear_dirty)
+		gd25q_wear_save(spidev);
+	up_write(&spidev->buf_lock);
+
+	schedule_delayed_work(&spidev->wear_work, wear_save_interval * HZ);
+}
+
+static void gd25q_wear_init(struct spidev_data *spidev, struct device_node *np)
+{
+	u32 offset, size;
+
+	spidev->wear_sectors = spidev->flash_size / GD25QXX_SECTOR;
+	spidev->wear = vzalloc(spidev->wear_sectors * sizeof(u32));
+	if (!spidev->wear)
+		return;
+	INIT_DELAYED_WORK(&spidev->wear_work, gd25q_wear_work);
+
+	if (of_property_read_u32(np, "wear-offset", &offset))
+		return;
+	spidev->wear_slot = ALIGN(sizeof(struct gd25q_wear_hdr) +
+			spidev->wear_sectors * sizeof(u32), GD25QXX_PAGE_LENGTH);
+	if (of_property_read_u32(np, "wear-size", &size))
+		size = ALIGN(spidev->wear_slot, GD25QXX_SECTOR);
+	if (!IS_ALIGNED(offset, GD25QXX_SECTOR) || !IS_ALIGNED(size, GD25QXX_SECTOR) ||
+	    size < spidev->wear_slot || size > spidev->flash_size ||
+	    offset > spidev->flash_size - size) {
+		dev_err(&spidev->spi->dev, "wear-offset %#x/wear-size %#x is invalid\n",
+			offset, size);
+		return;
+	}
+	spidev->wear_offset = offset;
+	spidev->wear_size = size;
+	gd25q_wear_load(spidev);
+
+	if (wear_save_interval)
+		schedule_delayed_work(&spidev->wear_work, wear_save_interval * HZ);
+}
+
+//卸载时保存一次，然后释放
+static void gd25q_wear_exit(struct spidev_data *spidev)
+{
+	if (!spidev->wear)
+		return;
+	if (spidev->wear_size) {
+		cancel_delayed_work_sync(&spidev->wear_work);
+		down_write(&spidev->buf_lock);
+		if (spidev->wear_dirty)
+			gd25q_wear_save(spidev);
+		up_write(&spidev->buf_lock);
+	}
+
+	down_write(&spidev->buf_lock);
+	vfree(spidev->wear);
+	spidev->wear = NULL;
+	up_write(&spidev->buf_lock);
+}
+
+/*-------------------------------------------------------------------------*/
+
+/*
+ * MTD接口：和/dev/GD25QXX共用buf_lock(读拿读锁)，不用tx/rx缓存。
+ * 按NOR的语义：写不带擦除，擦除按4KB扇区对齐，由mtd核心检查。
+ */
+static int gd25q_mtd_read(struct mtd_info *mtd, loff_t from, size_t len,
+		size_t *retlen, u_char *buf)
+{
+	struct spidev_data *spidev = mtd->priv;
+	ssize_t status;
+
+	down_read(&spidev->buf_lock);
+	status = gd25q_cache_read(spidev, from, buf, len, false);
+	up_read(&spidev->buf_lock);
+	if (status < 0)
+		return status;
+
+	atomic64_add(status, &spidev->stats.bytes_read);
+	*retlen = status;
+	return 0;
+}
+
+static int gd25q_mtd_write(struct mtd_info *mtd, loff_t to, size_t len,
+		size_t *retlen, const u_char *buf)
+{
+	struct spidev_data *spidev = mtd->priv;
+	ssize_t status = 0;
+	size_t n;
 
-	/* write requests */
-	case SPI_IOC_WR_MODE:
-	case SPI_IOC_WR_MODE32:
-		if (cmd == SPI_IOC_WR_MODE)
-			retval = __get_user(tmp, (u8 __user *)arg);
-		else
-			retval = __get_user(tmp, (u32 __user *)arg);
-		if (retval == 0) {
-			u32	save = spi->mode;
+	down_write(&spidev->buf_lock);
+	gd25q_wait_wipe(spidev, to, len);
+	if(spidev->wp_gpio != INVALID_GPIO_PIN)
+		gpio_set_value(spidev->wp_gpio, 1);
 
-			if (tmp & ~SPI_MODE_MASK) {
-				retval = -EINVAL;
-				break;
-			}
+	while (len > 0) {
+		//按页分开写
+		n = min_t(size_t, len, GD25QXX_PAGE_LENGTH - (to % GD25QXX_PAGE_LENGTH));
+		status = spi_gd25q_page_program(spidev, to, buf, n);
+		if (status < 0)
+			break;
+		to += n;
+		buf += n;
+		len -= n;
+		*retlen += n;
+	}
+	if (status >= 0)
+		status = spi_gd25q_wait_ready(spidev);
 
-			tmp |= spi->mode & ~SPI_MODE_MASK;
-			spi->mode = (u16)tmp;
-			retval = spi_setup(spi);
-			if (retval < 0)
-				spi->mode = save;
-			else
-				dev_dbg(&spi->dev, "spi mode %x\n", tmp);
-		}
-		break;
-	case SPI_IOC_WR_LSB_FIRST:
-		retval = __get_user(tmp, (__u8 __user *)arg);
-		if (retval == 0) {
-			u32	save = spi->mode;
+	if(spidev->wp_gpio != INVALID_GPIO_PIN)
+		gpio_set_value(spidev->wp_gpio, 0);
+	up_write(&spidev->buf_lock);
+	atomic64_add(*retlen, &spidev->stats.bytes_written);
 
-			if (tmp)
-				spi->mode |= SPI_LSB_FIRST;
-			else
-				spi->mode &= ~SPI_LSB_FIRST;
-			retval = spi_setup(spi);
-			if (retval < 0)
-				spi->mode = save;
-			else
-				dev_dbg(&spi->dev, "%csb first\n",
-						tmp ? 'l' : 'm');
-		}
-		break;
-	case SPI_IOC_WR_BITS_PER_WORD:
-		retval = __get_user(tmp, (__u8 __user *)arg);
-		if (retval == 0) {
-			u8	save = spi->bits_per_word;
+	return status < 0 ? status : 0;
+}
 
-			spi->bits_per_word = tmp;
-			retval = spi_setup(spi);
-			if (retval < 0)
-				spi->bits_per_word = save;
-			else
-				dev_dbg(&spi->dev, "%d bits per word\n", tmp);
-		}
-		break;
-	case SPI_IOC_WR_MAX_SPEED_HZ:
-		retval = __get_user(tmp, (__u32 __user *)arg);
-		if (retval == 0) {
-			u32	save = spi->max_speed_hz;
+static int gd25q_mtd_erase(struct mtd_info *mtd, struct erase_info *instr)
+{
+	struct spidev_data *spidev = mtd->priv;
+	int status;
 
-			spi->max_speed_hz = tmp;
-			retval = spi_setup(spi);
-			if (retval >= 0)
-				spidev->speed_hz = tmp;
-			else
-				dev_dbg(&spi->dev, "%d Hz (max)\n", tmp);
-			spi->max_speed_hz = save;
-		}
-		break;
-		default:
-			return -EINVAL;
+	down_write(&spidev->buf_lock);
+	if(spidev->wp_gpio != INVALID_GPIO_PIN)
+		gpio_set_value(spidev->wp_gpio, 1);
+
+	status = spi_gd25q_erase_range(spidev, instr->addr, instr->len, true);
+
+	if(spidev->wp_gpio != INVALID_GPIO_PIN)
+		gpio_set_value(spidev->wp_gpio, 0);
+	up_write(&spidev->buf_lock);
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 17, 0)
+	if (status < 0) {
+		instr->state = MTD_ERASE_FAILED;
+		instr->fail_addr = MTD_FAIL_ADDR_UNKNOWN;
+		return status;
 	}
+	instr->state = MTD_ERASE_DONE;
+	mtd_erase_callback(instr);
+#endif
+	return status < 0 ? status : 0;
+}
 
-	mutex_unlock(&spidev->buf_lock);
-	spi_dev_put(spi);
-	return retval;
+//dts里flash节点下的 partitions { compatible = "fixed-partitions"; ... } 由ofpart解析
+static int gd25q_mtd_register(struct spidev_data *spidev)
+{
+	struct spi_device *spi = spidev->spi;
+	struct mtd_info *mtd = &spidev->mtd;
+
+	mtd->name = dev_name(&spi->dev);
+	mtd->type = MTD_NORFLASH;
+	mtd->flags = MTD_CAP_NORFLASH;
+	mtd->size = spidev->flash_size;
+	mtd->erasesize = GD25QXX_SECTOR;
+	mtd->writesize = 1;            //NOR可以按字节写
+	mtd->writebufsize = GD25QXX_PAGE_LENGTH;
+	mtd->owner = THIS_MODULE;
+	mtd->priv = spidev;
+	mtd->dev.parent = &spi->dev;
+	mtd_set_of_node(mtd, spi->dev.of_node);
+	mtd->_read = gd25q_mtd_read;
+	mtd->_write = gd25q_mtd_write;
+	mtd->_erase = gd25q_mtd_erase;
+
+	return mtd_device_register(mtd, NULL, 0);
 }
 
-#ifdef CONFIG_COMPAT
-static long
-spidev_compat_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+/*-------------------------------------------------------------------------*/
+
+/*
+ * SFDP(JESD216)：芯片自己描述容量、擦除类型、快速读命令和各种操作时间。
+ * 主要用第一个参数表(JEDEC基本参数表BFPT)，DW10/DW11(时间、页大小)
+ * 是JESD216A才加的，老芯片没有就用默认值。
+ * 16MB以上的芯片再找4字节地址命令表(4BAIT，ID 0xFF84)。
+ */
+#define SFDP_SIGNATURE		0x50444653	//"SFDP"
+#define SFDP_BFPT_DWORDS	16
+#define SFDP_4BAIT_ID		0xff84
+#define SFDP_MAX_HEADERS	8
+
+static const unsigned int sfdp_erase_unit_ms[] = { 1, 16, 128, 1000 };
+static const unsigned int sfdp_chip_erase_unit_ms[] = { 16, 256, 4000, 64000 };
+
+//0x5A + 3字节地址 + 8个dummy时钟，单线读。SFDP在4字节地址模式下也是3字节地址
+static int spi_gd25q_read_sfdp(struct spidev_data *spidev, unsigned int addr,
+		void *buf, size_t len)
 {
-	return spidev_ioctl(filp, cmd, (unsigned long)compat_ptr(arg));
+	int status;
+	unsigned char cmd[5] = {READ_SFDP};
+	struct spi_transfer t[] = {
+		{
+			.tx_buf = cmd,
+			.len = ARRAY_SIZE(cmd),
+			.speed_hz = spidev->speed_hz,
+		},
+		{
+			.rx_buf = buf,
+			.len = len,
+			.speed_hz = spidev->speed_hz,
+		},
+	};
+	struct spi_message m;
+
+	cmd[1] = (unsigned char)((addr & 0xff0000) >> 16);
+	cmd[2] = (unsigned char)((addr & 0xff00) >> 8);
+	cmd[3] = (unsigned char)(addr & 0xff);
+
+	status = spi_gd25q_wait_ready(spidev);
+	if (status)
+		return status;
+	spi_message_init(&m);
+	spi_message_add_tail(&t[0], &m);
+	spi_message_add_tail(&t[1], &m);
+	status = spidev_sync(spidev, &m);
+	return status < 0 ? status : 0;
 }
-#else
-#define spidev_compat_ioctl NULL
-#endif /* CONFIG_COMPAT */
 
-static int spidev_open(struct inode *inode, struct file *filp)
+/*
+ * BFPT里一个快速读的参数(16位)：bit4-0 wait时钟，bit7-5 mode时钟，bit15-8 命令码。
+ * 驱动按字节发dummy，时钟数凑不成整字节的不用。
+ */
+static void gd25q_sfdp_read_op(struct spidev_data *spidev, unsigned mode,
+		bool supported, u16 param)
 {
-	struct spidev_data	*spidev;
-	int			status = -ENXIO;
+	struct gd25q_read_op *op = &spidev->read_ops[mode];
+	unsigned int bits = ((param & 0x1f) + ((param >> 5) & 0x7)) * op->addr_nbits;
 
-	printk("bufsiz = %d\n",bufsiz);
-	mutex_lock(&device_list_lock);
+	if (!supported || !(param >> 8) || bits % 8 || bits / 8 > GD25Q_MAX_DUMMY) {
+		op->opcode = 0;
+		return;
+	}
+	op->opcode = param >> 8;
+	op->dummy = bits / 8;
+}
 
-	list_for_each_entry(spidev, &device_list, device_entry) {
-		if (spidev->devt == inode->i_rdev) {
-			status = 0;
-			break;
-		}
+/*
+ * 在参数头里找4BAIT，找到时op4b[0]是支持位(GD25Q_4B_xxx)，op4b[1]是
+ * 4种擦除类型的4字节命令码。找不到不算错误。
+ */
+static void gd25q_sfdp_4bait(struct spidev_data *spidev, unsigned int nph,
+		u8 *buf, u32 op4b[2])
+{
+	unsigned int i, ptp;
+
+	for (i = 1; i <= nph && i < SFDP_MAX_HEADERS; i++) {
+		if (spi_gd25q_read_sfdp(spidev, 8 + 8 * i, buf, 8))
+			return;
+		if ((buf[0] | buf[7] << 8) != SFDP_4BAIT_ID || buf[3] < 2)
+			continue;
+		ptp = buf[4] | buf[5] << 8 | buf[6] << 16;
+		if (spi_gd25q_read_sfdp(spidev, ptp, buf, 8))
+			return;
+		op4b[0] = get_unaligned_le32(buf);
+		op4b[1] = get_unaligned_le32(buf + 4);
+		return;
 	}
+}
 
-	if (status) {
-		pr_debug("spidev: nothing for minor %d\n", iminor(inode));
-		goto err_find_dev;
+static int gd25q_parse_sfdp(struct spidev_data *spidev, u32 op4b[2])
+{
+	struct gd25qxx_geometry *geo = &spidev->geo;
+	struct gd25qxx_erase_type erase[4];
+	unsigned int i, n, ptp, mult, typ, shift, nph;
+	bool has_4k = false;
+	u64 bits;
+	u32 *dw;
+	u8 *hdr;
+	int status;
+
+	dw = kmalloc(SFDP_BFPT_DWORDS * sizeof(u32), GFP_KERNEL);
+	if (!dw)
+		return -ENOMEM;
+	hdr = (u8 *)dw;
+
+	//SFDP头(8字节) + 第一个参数头(8字节)，第一个参数表必须是BFPT(ID 0x00，主版本1)
+	status = spi_gd25q_read_sfdp(spidev, 0, hdr, 16);
+	if (status)
+		goto out;
+	if (get_unaligned_le32(hdr) != SFDP_SIGNATURE || hdr[8] != 0x00 || hdr[10] != 1) {
+		status = -ENODEV;
+		goto out;
+	}
+	nph = hdr[6];
+	n = min_t(unsigned int, hdr[11], SFDP_BFPT_DWORDS);
+	ptp = hdr[12] | hdr[13] << 8 | hdr[14] << 16;
+	if (n < 9) {
+		status = -EINVAL;
+		goto out;
+	}
+	status = spi_gd25q_read_sfdp(spidev, ptp, dw, n * sizeof(u32));
+	if (status)
+		goto out;
+	for (i = 0; i < n; i++)
+		le32_to_cpus(&dw[i]);
+
+	//DW2 容量，bit31为1时是2^N位
+	if (dw[1] & BIT(31)) {
+		shift = dw[1] & 0x7fffffff;
+		bits = shift < 36 ? 1ULL << shift : 0;
+	} else {
+		bits = (u64)dw[1] + 1;
+	}
+	if (bits / 8 < GD25QXX_64KB_BLOCK || bits / 8 > U32_MAX) {
+		status = -EINVAL;
+		goto out;
 	}
 
-	if (!spidev->tx_buffer) {
-		spidev->tx_buffer = kmalloc(bufsiz, GFP_KERNEL);
-		if (!spidev->tx_buffer) {
-			dev_err(&spidev->spi->dev, "open/ENOMEM\n");
-			status = -ENOMEM;
-			goto err_find_dev;
-		}
+	//DW8/DW9 四种擦除类型：bit7-0 大小(2^N字节)，bit15-8 命令码
+	memset(erase, 0, sizeof(erase));
+	for (i = 0; i < 4; i++) {
+		u32 e = dw[7 + i / 2] >> (16 * (i % 2));
+
+		shift = e & 0xff;
+		if (!shift || shift >= 32)
+			continue;
+		erase[i].size = 1U << shift;
+		erase[i].opcode = (e >> 8) & 0xff;
+		if (erase[i].size == GD25QXX_SECTOR)
+			has_4k = true;
+	}
+	if (!has_4k) {   //改写扇区要用4KB擦除
+		status = -EINVAL;
+		goto out;
 	}
 
-	if (!spidev->rx_buffer) {
-		spidev->rx_buffer = kmalloc(bufsiz, GFP_KERNEL);
-		if (!spidev->rx_buffer) {
-			dev_err(&spidev->spi->dev, "open/ENOMEM\n");
-			status = -ENOMEM;
-			goto err_alloc_rx_buf;
+	//DW10 擦除时间：bit3-0 最大时间倍数，每种类型5位个数+2位单位
+	if (n >= 11) {
+		mult = 2 * ((dw[9] & 0xf) + 1);
+		for (i = 0; i < 4; i++) {
+			if (!erase[i].size)
+				continue;
+			typ = ((dw[9] >> (4 + 7 * i)) & 0x1f) + 1;
+			typ *= sfdp_erase_unit_ms[(dw[9] >> (9 + 7 * i)) & 3];
+			erase[i].typ_ms = typ;
+			erase[i].max_ms = typ * mult;
 		}
 	}
 
-	spidev->users++;
-	filp->private_data = spidev;
+	geo->size = bits / 8;
+	memcpy(geo->erase, erase, sizeof(erase));
+
+	//DW1里的支持位，DW3是1-4-4和1-1-4，DW4是1-1-2
+	gd25q_sfdp_read_op(spidev, GD25QXX_READ_DUAL, dw[0] & BIT(16), dw[3] & 0xffff);
+	gd25q_sfdp_read_op(spidev, GD25QXX_READ_QUAD, dw[0] & BIT(22), dw[2] >> 16);
+	gd25q_sfdp_read_op(spidev, GD25QXX_READ_QUAD_IO, dw[0] & BIT(21), dw[2] & 0xffff);
+
+	//DW11 页大小、页编程和整片擦除时间，最大时间倍数在bit3-0
+	if (n >= 11) {
+		mult = 2 * ((dw[10] & 0xf) + 1);
+		geo->page_size = 1U << ((dw[10] >> 4) & 0xf);
+		typ = (((dw[10] >> 8) & 0x1f) + 1) * ((dw[10] & BIT(13)) ? 64 : 8);
+		geo->page_program_typ_us = typ;
+		geo->page_program_max_us = typ * mult;
+		typ = (((dw[10] >> 24) & 0x1f) + 1) * sfdp_chip_erase_unit_ms[(dw[10] >> 29) & 3];
+		geo->chip_erase_typ_ms = typ;
+		geo->chip_erase_max_ms = typ * mult;
+	}
 
-	mutex_unlock(&device_list_lock);
-	return 0;
+	//DW12 bit31为1表示不支持暂停，bit23-20 擦除恢复到下一次暂停的间隔；DW13 暂停/恢复命令
+	if (n >= 13) {
+		if (dw[11] & BIT(31)) {
+			spidev->suspend_opcode = 0;
+		} else {
+			spidev->suspend_opcode = dw[12] >> 24;
+			spidev->resume_opcode = (dw[12] >> 16) & 0xff;
+			spidev->suspend_interval_us = (((dw[11] >> 20) & 0xf) + 1) * 64;
+		}
+	}
 
-err_alloc_rx_buf:
-	kfree(spidev->tx_buffer);
-	spidev->tx_buffer = NULL;
-err_find_dev:
-	mutex_unlock(&device_list_lock);
+	//DW1 bit18-17 地址字节数：0只有3字节，1可以切换，2只有4字节。dw后面当缓冲区用
+	if (((dw[0] >> 17) & 3) == 2)
+		geo->addr_mode = GD25QXX_ADDR_4B_ONLY;
+	else if (geo->size > 0x1000000)
+		gd25q_sfdp_4bait(spidev, nph, (u8 *)dw, op4b);
+	geo->source = GD25QXX_GEOM_SFDP;
+out:
+	kfree(dw);
 	return status;
 }
 
-static int spidev_release(struct inode *inode, struct file *filp)
+//查询间隔取典型时间的1/8，超时取最大时间的2倍，SFDP没给时间的保持默认
+static void gd25q_set_timing(struct gd25q_busy_timing *tm, u64 typ_us,
+		unsigned int max_ms)
 {
-	struct spidev_data	*spidev;
+	if (!typ_us || !max_ms)
+		return;
+	tm->poll_us = clamp_t(u64, div_u64(typ_us, 8), 50, 100000);
+	tm->timeout_ms = max(2 * max_ms, 10U);
+}
 
-	mutex_lock(&device_list_lock);
-	spidev = filp->private_data;
-	filp->private_data = NULL;
+/*
+ * 16MB以上的芯片要用4字节地址。优先用4字节地址的专用命令，芯片一直留在
+ * 3字节地址模式，热重启、看门狗复位以后BootROM和u-boot照样按3字节地址读flash；
+ * 不知道芯片有没有这些命令(SFDP没有4BAIT，ID表里也没标)时才发EN4B，
+ * 卸载和关机时再发EX4B退回3字节模式。
+ * 用专用命令时，芯片没有4字节命令的读模式和擦除类型就不用了。
+ */
+static int gd25q_set_addr_mode(struct spidev_data *spidev, const u32 op4b[2])
+{
+	struct gd25qxx_geometry *geo = &spidev->geo;
+	u32 need = GD25Q_4B_FAST | GD25Q_4B_PP;
+	u8 cmd = ENTER_4B_MODE;
+	int i, status;
+
+	spidev->pp_opcode = PAGE_PROGRAM;
+	spidev->addr_width = 3;
+	if (geo->addr_mode == GD25QXX_ADDR_4B_ONLY) {
+		spidev->addr_width = 4;
+		return 0;
+	}
+	geo->addr_mode = GD25QXX_ADDR_3B;
+	if (geo->size <= 0x1000000)
+		return 0;
 
-	/* last close? */
-	spidev->users--;
-	if (!spidev->users) {
-		int		dofree;
+	for (i = 0; i < ARRAY_SIZE(geo->erase); i++)
+		if (geo->erase[i].size == GD25QXX_SECTOR)
+			need |= GD25Q_4B_ERASE(i);
 
-		kfree(spidev->tx_buffer);
-		spidev->tx_buffer = NULL;
+	if ((op4b[0] & need) == need) {
+		for (i = GD25QXX_READ_NORMAL; i <= GD25QXX_READ_MODE_MAX; i++) {
+			struct gd25q_read_op *op = &spidev->read_ops[i];
 
-		kfree(spidev->rx_buffer);
-		spidev->rx_buffer = NULL;
+			if (op->opcode && (op4b[0] & gd25q_read_ops_4b[i].bit))
+				op->opcode = gd25q_read_ops_4b[i].opcode;
+			else
+				op->opcode = 0;
+		}
+		for (i = 0; i < ARRAY_SIZE(geo->erase); i++) {
+			struct gd25qxx_erase_type *e = &geo->erase[i];
 
-		spin_lock_irq(&spidev->spi_lock);
-		if (spidev->spi)
-			spidev->speed_hz = spidev->spi->max_speed_hz;
+			if (op4b[0] & GD25Q_4B_ERASE(i))
+				e->opcode = (op4b[1] >> (8 * i)) & 0xff;
+			else
+				memset(e, 0, sizeof(*e));
+		}
+		spidev->pp_opcode = PAGE_PROGRAM_4B;
+		geo->addr_mode = GD25QXX_ADDR_4B_OPCODES;
+	} else {
+		status = spi_write_then_read(spidev->spi, &cmd, 1, NULL, 0);
+		if (status)
+			return status;
+		geo->addr_mode = GD25QXX_ADDR_EN4B;
+	}
+	spidev->addr_width = 4;
+	return 0;
+}
 
-		/* ... after we unbound from the underlying device? */
-		dofree = (spidev->spi == NULL);
-		spin_unlock_irq(&spidev->spi_lock);
+//EN4B模式下退回3字节地址模式
+static void gd25q_exit_4b_mode(struct spidev_data *spidev)
+{
+	u8 cmd = EXIT_4B_MODE;
 
-		if (dofree)
-			kfree(spidev);
+	if (spidev->geo.addr_mode != GD25QXX_ADDR_EN4B)
+		return;
+	if (spi_gd25q_wait_ready(spidev) == 0)
+		spi_write_then_read(spidev->spi, &cmd, 1, NULL, 0);
+}
+
+/*
+ * 确定芯片的参数：先读SFDP，读不到按JEDEC ID查表，再不行用dts的flash_size，
+ * 都没有就按1MB。dts里的flash_size和芯片不一致时以芯片为准。
+ */
+static void gd25q_probe_geometry(struct spidev_data *spidev, struct device_node *np)
+{
+	struct gd25qxx_geometry *geo = &spidev->geo;
+	struct device *dev = &spidev->spi->dev;
+	const char *name = NULL;
+	u32 dt_size = 0;
+	u32 op4b[2] = {0, 0};
+	int i;
+
+	memcpy(spidev->read_ops, gd25q_read_ops, sizeof(spidev->read_ops));
+	memcpy(spidev->busy_timing, gd25q_busy_timing, sizeof(spidev->busy_timing));
+	memcpy(geo->erase, gd25q_default_erase, sizeof(geo->erase));
+	geo->jedec_id = spidev->flash_id;
+	geo->page_size = GD25QXX_PAGE_LENGTH;
+	geo->page_program_max_us = 2400;
+	geo->chip_erase_max_ms = 60000;
+	spidev->suspend_opcode = ERASE_SUSPEND;
+	spidev->resume_opcode = ERASE_RESUME;
+	spidev->suspend_interval_us = 100;   //GD25Q64C的tRS
+
+	of_property_read_u32(np, "flash_size", &dt_size);
+
+	if (gd25q_parse_sfdp(spidev, op4b) == 0) {
+		name = "sfdp";
+	} else {
+		for (i = 0; i < ARRAY_SIZE(gd25q_flash_ids); i++) {
+			if (gd25q_flash_ids[i].jedec_id == spidev->flash_id) {
+				geo->size = gd25q_flash_ids[i].size;
+				geo->source = GD25QXX_GEOM_ID_TABLE;
+				name = gd25q_flash_ids[i].name;
+				//擦除类型按gd25q_default_erase的顺序，0是4KB，2是64KB
+				if (gd25q_flash_ids[i].flags & GD25Q_F_4B_OPCODES) {
+					op4b[0] = GD25Q_4B_READ | GD25Q_4B_FAST | GD25Q_4B_PP |
+						GD25Q_4B_ERASE(0) | GD25Q_4B_ERASE(2);
+					op4b[1] = SECTOR_ERASE_4B | BLOCK_64KB_ERASE_4B << 16;
+				}
+				break;
+			}
+		}
 	}
-	mutex_unlock(&device_list_lock);
 
-	return 0;
-}
+	if (!geo->size) {
+		geo->source = GD25QXX_GEOM_DT;
+		name = "dts";
+		geo->size = dt_size;
+		if (!geo->size) {
+			dev_err(dev, "flash_size is invalid,please define flash_size,use default size 1MB\n");
+			geo->size = 0x100000;   //最小是1M
+		}
+	} else if (dt_size && dt_size != geo->size) {
+		dev_warn(dev, "flash_size %#x in dts ignored, chip has %#x\n",
+			dt_size, geo->size);
+	}
+	if (gd25q_set_addr_mode(spidev, op4b)) {
+		dev_err(dev, "enter 4-byte address mode failed, use first 16MB only\n");
+		geo->size = 0x1000000;
+	}
+	geo->addr_bytes = spidev->addr_width;
+	spidev->flash_size = geo->size;
+
+	if (geo->page_size != GD25QXX_PAGE_LENGTH)
+		dev_warn(dev, "page size %u, driver programs %u bytes per page\n",
+			geo->page_size, GD25QXX_PAGE_LENGTH);
+
+	for (i = 0; i < ARRAY_SIZE(geo->erase); i++) {
+		struct gd25qxx_erase_type *e = &geo->erase[i];
+		enum gd25q_busy_op op;
+
+		if (e->size == GD25QXX_SECTOR)
+			op = GD25Q_BUSY_SE;
+		else if (e->size == GD25QXX_32KB_BLOCK)
+			op = GD25Q_BUSY_BE32;
+		else if (e->size == GD25QXX_64KB_BLOCK)
+			op = GD25Q_BUSY_BE64;
+		else
+			continue;
+		gd25q_set_timing(&spidev->busy_timing[op], (u64)e->typ_ms * 1000, e->max_ms);
+	}
+	gd25q_set_timing(&spidev->busy_timing[GD25Q_BUSY_PP], geo->page_program_typ_us,
+			DIV_ROUND_UP(geo->page_program_max_us, 1000));
+	gd25q_set_timing(&spidev->busy_timing[GD25Q_BUSY_CE],
+			(u64)geo->chip_erase_typ_ms * 1000, geo->chip_erase_max_ms);
+
+	for (i = GD25QXX_READ_NORMAL; i <= GD25QXX_READ_MODE_MAX; i++) {
+		const struct gd25q_read_op *op = &spidev->read_ops[i];
+
+		geo->read[i].opcode = op->opcode;
+		geo->read[i].addr_width = op->addr_nbits;
+		geo->read[i].data_width = op->data_nbits;
+		geo->read[i].dummy_clocks = op->dummy * 8 / op->addr_nbits;
+	}
 
-static const struct file_operations spidev_fops = {
-	.owner =	THIS_MODULE,
-	/* REVISIT switch to aio primitives, so that userspace
-	 * gets more complete API coverage.  It'll simplify things
-	 * too, except for the locking.
-	 */
-	.write =	spidev_write,
-	.read =		spidev_read,
-	.unlocked_ioctl = spidev_ioctl,
-	.compat_ioctl = spidev_compat_ioctl,
-	.open =		spidev_open,
-	.release =	spidev_release,
-	.llseek =	spi_gd25q_llseek,
-};
+	dev_info(dev, "%s: %u KB, id %06x, page %u, %u-byte address\n", name,
+		geo->size >> 10, spidev->flash_id, geo->page_size, geo->addr_bytes);
+}
 
 /*-------------------------------------------------------------------------*/
 
@@ -1249,10 +4250,18 @@ static int spidev_probe(struct spi_device *spi)
 
 	/* Initialize the driver data */
 	spidev->spi = spi;
+	spidev->busy_op = GD25Q_BUSY_UNKNOWN;
 	spin_lock_init(&spidev->spi_lock);
-	mutex_init(&spidev->buf_lock);
+	init_rwsem(&spidev->buf_lock);
+	mutex_init(&spidev->io_lock);
+	mutex_init(&spidev->cache_lock);
 
 	INIT_LIST_HEAD(&spidev->device_entry);
+	INIT_LIST_HEAD(&spidev->cache_lru);
+	INIT_WORK(&spidev->stream_work, gd25q_stream_work);
+	INIT_WORK(&spidev->erase_work, gd25q_erase_job_work);
+	init_waitqueue_head(&spidev->erase_wait);
+	init_waitqueue_head(&spidev->wipe_wait);
 
 	/* If we can allocate a minor number, hook up this device.
 	 * Reusing minors is fine so long as udev or mdev is working.
@@ -1280,8 +4289,10 @@ static int spidev_probe(struct spi_device *spi)
 
 	if (status == 0)
 		spi_set_drvdata(spi, spidev);
-	else
+	else {
 		kfree(spidev);
+		return status;
+	}
 
 
 	spidev->wp_gpio = of_get_named_gpio(np, "wp-gpio", 0);
@@ -1303,14 +4314,27 @@ static int spidev_probe(struct spi_device *spi)
 		gpio_export(spidev->wp_gpio, 0);    	
     }
 
-	if (of_property_read_u32(np, "flash_size", &spidev->flash_size)) {
-        dev_err(&spi->dev, "flash_size is invalid,please define flash_size,use default size 1MB\n");
-    //    return -ENODEV;
-        spidev->flash_size = 0x100000;   //最小是1M
-    }
-	dev_info(&spi->dev, "get flash_size: %#x \n", spidev->flash_size);
-
 	spidev->flash_id = spi_read_gd25q_id_0(spi);
+	gd25q_probe_geometry(spidev, np);
+
+	if (spi_gd25q_set_read_mode(spidev, read_mode)) {
+		dev_err(&spi->dev, "read_mode %u not supported, use auto\n", read_mode);
+		spi_gd25q_set_read_mode(spidev, GD25QXX_READ_AUTO);
+	}
+
+	//分配不到就不记录，写和擦除按原来的方式做
+	spidev->blank_sectors = spidev->flash_size / GD25QXX_SECTOR;
+	spidev->blank = kcalloc(BITS_TO_LONGS(spidev->blank_sectors),
+			sizeof(unsigned long), GFP_KERNEL);
+
+	gd25q_wear_init(spidev, np);
+	gd25q_debugfs_init(spidev);
+
+	//mtd注册失败不影响/dev/GD25QXX的使用
+	if (gd25q_mtd_register(spidev))
+		dev_err(&spi->dev, "mtd register failed\n");
+	else
+		spidev->mtd_registered = true;
 
 	return status;
 }
@@ -1319,6 +4343,23 @@ static int spidev_remove(struct spi_device *spi)
 {
 	struct spidev_data	*spidev = spi_get_drvdata(spi);
 
+	if (spidev->mtd_registered)
+		mtd_device_unregister(&spidev->mtd);
+	debugfs_remove_recursive(spidev->debugfs);
+	gd25q_wear_exit(spidev);
+
+	down_write(&spidev->buf_lock);
+	gd25q_stream_stop(spidev);
+	if (spidev->erase_status == -EINPROGRESS)
+		spidev->erase_status = -ECANCELED;   //异步擦除做完当前的块就停
+	up_write(&spidev->buf_lock);
+	cancel_work_sync(&spidev->stream_work);
+	cancel_work_sync(&spidev->erase_work);
+
+	down_write(&spidev->buf_lock);
+	gd25q_exit_4b_mode(spidev);
+	up_write(&spidev->buf_lock);
+
 	if(spidev->wp_gpio != INVALID_GPIO_PIN)   //引脚不存在
 		gpio_free(spidev->wp_gpio);
 
@@ -1327,6 +4368,12 @@ static int spidev_remove(struct spi_device *spi)
 	spidev->spi = NULL;
 	spin_unlock_irq(&spidev->spi_lock);
 
+	down_write(&spidev->buf_lock);
+	gd25q_cache_flush(spidev);
+	kfree(spidev->blank);
+	spidev->blank = NULL;
+	up_write(&spidev->buf_lock);
+
 	/* prevent new opens */
 	mutex_lock(&device_list_lock);
 	list_del(&spidev->device_entry);
@@ -1339,6 +4386,16 @@ static int spidev_remove(struct spi_device *spi)
 	return 0;
 }
 
+//重启前退出EN4B模式，不然BootROM按3字节地址读不到东西
+static void spidev_shutdown(struct spi_device *spi)
+{
+	struct spidev_data	*spidev = spi_get_drvdata(spi);
+
+	down_write(&spidev->buf_lock);
+	gd25q_exit_4b_mode(spidev);
+	up_write(&spidev->buf_lock);
+}
+
 static struct spi_driver spidev_spi_driver = {
 	.driver = {
 		.name =		"GD25QXX",
@@ -1346,6 +4403,7 @@ static struct spi_driver spidev_spi_driver = {
 	},
 	.probe =	spidev_probe,
 	.remove =	spidev_remove,
+	.shutdown =	spidev_shutdown,
 
 	/* NOTE:  suspend/resume methods are not necessary here.
 	 * We don't do anything except pass the requests to/from
@@ -1365,13 +4423,27 @@ static int __init spidev_init(void)
 	 * the driver which manages those device numbers.
 	 */
 	BUILD_BUG_ON(N_SPI_MINORS > 256);
+	//改写扇区时tx/rx缓存要能放下一个整扇区
+	if (bufsiz < GD25QXX_SECTOR)
+		bufsiz = GD25QXX_SECTOR;
+
+	gd25q_wq = alloc_workqueue("gd25qxx", WQ_UNBOUND, 0);
+	if (!gd25q_wq)
+		return -ENOMEM;
+	gd25q_debugfs_root = debugfs_create_dir("gd25qxx", NULL);
+
 	status = register_chrdev(SPIDEV_MAJOR, "GD25QXX", &spidev_fops);
-	if (status < 0)
+	if (status < 0) {
+		debugfs_remove_recursive(gd25q_debugfs_root);
+		destroy_workqueue(gd25q_wq);
 		return status;
+	}
 
 	spidev_class = class_create(THIS_MODULE, "GD25QXX");
 	if (IS_ERR(spidev_class)) {
 		unregister_chrdev(SPIDEV_MAJOR, spidev_spi_driver.driver.name);
+		debugfs_remove_recursive(gd25q_debugfs_root);
+		destroy_workqueue(gd25q_wq);
 		return PTR_ERR(spidev_class);
 	}
 
@@ -1379,6 +4451,8 @@ static int __init spidev_init(void)
 	if (status < 0) {
 		class_destroy(spidev_class);
 		unregister_chrdev(SPIDEV_MAJOR, spidev_spi_driver.driver.name);
+		debugfs_remove_recursive(gd25q_debugfs_root);
+		destroy_workqueue(gd25q_wq);
 	}
 	return status;
 }
@@ -1389,6 +4463,8 @@ static void __exit spidev_exit(void)
 	spi_unregister_driver(&spidev_spi_driver);
 	class_destroy(spidev_class);
 	unregister_chrdev(SPIDEV_MAJOR, spidev_spi_driver.driver.name);
+	debugfs_remove_recursive(gd25q_debugfs_root);
+	destroy_workqueue(gd25q_wq);
 }
 module_exit(spidev_exit);
 
@@ -0,0 +1,165 @@
+/*
+ * gd25qxx 驱动的trace event，用ftrace/perf看每个flash操作的地址、长度和耗时：
+ *   echo 1 > /sys/kernel/debug/tracing/events/gd25qxx/enable
+ *   cat /sys/kernel/debug/tracing/trace_pipe
+ * 时间都是纳秒。erase/page_program的时间只是发命令的时间，
+ * 芯片实际擦除/编程用的时间看对应的gd25q_wait_ready。
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM gd25qxx
+
+#if !defined(_GD25QXX_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _GD25QXX_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#ifndef _GD25QXX_TRACE_ENUMS
+#define _GD25QXX_TRACE_ENUMS
+//GD25qxx_write_pages对一个扇区的处理方式
+enum gd25q_rmw_action {
+	GD25Q_RMW_UNCHANGED,	//内容没变，什么都不做
+	GD25Q_RMW_PROGRAM,	//不用擦除，直接编程
+	GD25Q_RMW_ERASE,	//读出来、擦除、整个扇区重新写
+	GD25Q_RMW_ERASED,	//已经块擦除过，直接编程
+};
+#endif
+
+DECLARE_EVENT_CLASS(gd25q_xfer,
+
+	TP_PROTO(unsigned int addr, unsigned int len, u64 ns, int ret),
+
+	TP_ARGS(addr, len, ns, ret),
+
+	TP_STRUCT__entry(
+		__field(unsigned int,	addr)
+		__field(unsigned int,	len)
+		__field(u64,		ns)
+		__field(int,		ret)
+	),
+
+	TP_fast_assign(
+		__entry->addr = addr;
+		__entry->len = len;
+		__entry->ns = ns;
+		__entry->ret = ret;
+	),
+
+	TP_printk("addr=%#x len=%u %llu ns ret=%d",
+		__entry->addr, __entry->len,
+		(unsigned long long)__entry->ns, __entry->ret)
+);
+
+//一次读命令(包括它后面连续读出的所有数据)
+DEFINE_EVENT(gd25q_xfer, gd25q_read,
+	TP_PROTO(unsigned int addr, unsigned int len, u64 ns, int ret),
+	TP_ARGS(addr, len, ns, ret)
+);
+
+//一次页编程命令(WREN+PP)
+DEFINE_EVENT(gd25q_xfer, gd25q_page_program,
+	TP_PROTO(unsigned int addr, unsigned int len, u64 ns, int ret),
+	TP_ARGS(addr, len, ns, ret)
+);
+
+//擦除命令，opcode区分4KB/32KB/64KB/整片
+TRACE_EVENT(gd25q_erase,
+
+	TP_PROTO(u8 opcode, unsigned int addr, unsigned int len, u64 ns, int ret),
+
+	TP_ARGS(opcode, addr, len, ns, ret),
+
+	TP_STRUCT__entry(
+		__field(u8,		opcode)
+		__field(unsigned int,	addr)
+		__field(unsigned int,	len)
+		__field(u64,		ns)
+		__field(int,		ret)
+	),
+
+	TP_fast_assign(
+		__entry->opcode = opcode;
+		__entry->addr = addr;
+		__entry->len = len;
+		__entry->ns = ns;
+		__entry->ret = ret;
+	),
+
+	TP_printk("op=%#04x addr=%#x len=%u %llu ns ret=%d",
+		__entry->opcode, __entry->addr, __entry->len,
+		(unsigned long long)__entry->ns, __entry->ret)
+);
+
+//等芯片空闲，ns是从发出命令到WIP清零的时间，polls是读状态寄存器的次数
+TRACE_EVENT(gd25q_wait_ready,
+
+	TP_PROTO(const char *op, unsigned int addr, unsigned int len,
+		 u64 ns, unsigned int polls, int ret),
+
+	TP_ARGS(op, addr, len, ns, polls, ret),
+
+	TP_STRUCT__entry(
+		__string(op,		op)
+		__field(unsigned int,	addr)
+		__field(unsigned int,	len)
+		__field(u64,		ns)
+		__field(unsigned int,	polls)
+		__field(int,		ret)
+	),
+
+	TP_fast_assign(
+		__assign_str(op, op);
+		__entry->addr = addr;
+		__entry->len = len;
+		__entry->ns = ns;
+		__entry->polls = polls;
+		__entry->ret = ret;
+	),
+
+	TP_printk("%s addr=%#x len=%u %llu ns polls=%u ret=%d",
+		__get_str(op), __entry->addr, __entry->len,
+		(unsigned long long)__entry->ns, __entry->polls, __entry->ret)
+);
+
+//扇区内写入的处理方式，pages是实际编程的页数，ns是整个扇区处理完的时间
+TRACE_EVENT(gd25q_rmw,
+
+	TP_PROTO(unsigned int addr, unsigned int len, int action,
+		 unsigned int pages, u64 ns, int ret),
+
+	TP_ARGS(addr, len, action, pages, ns, ret),
+
+	TP_STRUCT__entry(
+		__field(unsigned int,	addr)
+		__field(unsigned int,	len)
+		__field(int,		action)
+		__field(unsigned int,	pages)
+		__field(u64,		ns)
+		__field(int,		ret)
+	),
+
+	TP_fast_assign(
+		__entry->addr = addr;
+		__entry->len = len;
+		__entry->action = action;
+		__entry->pages = pages;
+		__entry->ns = ns;
+		__entry->ret = ret;
+	),
+
+	TP_printk("addr=%#x len=%u %s pages=%u %llu ns ret=%d",
+		__entry->addr, __entry->len,
+		__print_symbolic(__entry->action,
+			{ GD25Q_RMW_UNCHANGED,	"unchanged" },
+			{ GD25Q_RMW_PROGRAM,	"program" },
+			{ GD25Q_RMW_ERASE,	"erase" },
+			{ GD25Q_RMW_ERASED,	"erased" }),
+		__entry->pages, (unsigned long long)__entry->ns, __entry->ret)
+);
+
+#endif /* _GD25QXX_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE gd25qxx_trace
+#include <trace/define_trace.h>